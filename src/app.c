@@ -61,6 +61,27 @@ static void button_press_func(uint8_t button_id, button_event_e event)
     NVIC_SystemReset();
 }
 
+/**
+ * \brief   Callback of Otap_process()
+ * \param   result
+ *          APP_RET_OK if the scratchpad is written
+ *
+ * Clears the OTAP request and resets the device, so that the stack
+ * processes the scratchpad and the new firmware is started.
+ */
+static void otap_processed(int result)
+{
+    if (result != APP_RES_OK) {
+        LOG(LVL_ERROR, "OTAP failed, error code: %d", result);
+    }
+    // reset m_app_settings.do_otap to 0
+    m_app_settings.do_otap = 0;
+    AppSettings_store(&m_app_settings);
+
+    // reset the device, so that the new firmware can be started
+    NVIC_SystemReset();
+}
+
 /** WM-SDK Entry function */
 void App_init(const app_global_functions_t* functions) {
     LOG_INIT();
@@ -83,20 +104,16 @@ void App_init(const app_global_functions_t* functions) {
     // check if we have to do an OTAP
     if (m_app_settings.do_otap == 1) {
         LOG(LVL_INFO, "OTAP requested, starting OTAP");
-        // copy otap buffer to scratch
-        uint32_t ret = Otap_init();
+        // copy otap buffer to scratch in the background, do_otap stays set
+        // till the copy is done, a reset meanwhile starts it again
+        int ret = Otap_init();
         if (ret == APP_RES_OK) {
-          ret = Otap_process();
+          ret = Otap_process(otap_processed);
         }
         if (ret != APP_RES_OK) {
-            LOG(LVL_ERROR, "OTAP failed, error code: %d", ret);
+            otap_processed(ret);
         }
-        // reset m_app_settings.do_otap to 0
-        m_app_settings.do_otap = 0;
-        AppSettings_store(&m_app_settings);
-
-        // reset the device, so that the new firmware can be started
-        NVIC_SystemReset();
+        return;
     }
 
     // Turn LED on if we are a sink
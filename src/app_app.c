@@ -42,6 +42,9 @@ char* Sm_getStateName(sm_state_e sm_state) {
 
     case ble_S_CONNECTED:
         return "ble_S_CONNECTED";
+
+    case sm_S_COUNT:
+        break;
     }
     return "-- state not known --";
 }
@@ -75,6 +78,8 @@ char* Sm_getEventName(sm_event_e sm_event) {
     case ble_E_TIMEOUT:
         return "ble_E_TIMEOUT";
 
+    case sm_E_COUNT:
+        break;
     }
 
 
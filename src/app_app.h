@@ -19,6 +19,7 @@
 #ifndef APP_APP_H_
 #define APP_APP_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -83,6 +84,9 @@ typedef enum {
     /** The connection to the Smartphone successfully established
      * Login is not required for this. */
     ble_S_CONNECTED,
+
+    /** number of states, keep it last (size of the transition index) */
+    sm_S_COUNT,
 } sm_state_e;
 
 /** Events */
@@ -108,6 +112,9 @@ typedef enum {
     ble_E_CONNECTED,
     /** @ref sm_M_BLE did not receive a advertising from smartphone within given Timeout  */
     ble_E_TIMEOUT,
+
+    /** number of events, keep it last (size of the transition index) */
+    sm_E_COUNT,
 } sm_event_e;
 
 
@@ -0,0 +1,41 @@
+/* *
+ * Wirepas BLE communication example
+ *
+ * Made in the swiss alps, 2023 <marcel.graber@steinel.ch>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    crc.h
+ * @brief   CRC32 (IEEE 802.3, same as zlib) shared with the smartphone
+ *
+ */
+#ifndef CRC_H
+#define CRC_H
+
+#include "app_app.h"
+
+/** start value for @ref Crc32_update */
+#define CRC32_INIT 0x00000000
+
+/** @brief continue a CRC32 over the next bytes
+ *
+ * @param crc CRC32_INIT or the result of the previous call
+ * @param data next bytes
+ * @param len number of bytes
+ * @return CRC32 including data
+ */
+uint32_t Crc32_update(uint32_t crc, const uint8_t* data, size_t len);
+
+#endif
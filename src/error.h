@@ -56,6 +56,10 @@ extern "C" {
 #define APP_RET_RESOURCES                   (ERROR_BASE_NUM + 17) ///< Not enough resources for operation
 #define APP_RET_TASK_ERROR                  (ERROR_BASE_NUM + 18) ///< Failure in starting or stopping task
 
+#define APP_RET_OTAP_BASE_VERSION           (ERROR_BASE_BLE_NUM + 0) ///< Delta upload made for another firmware version
+#define APP_RET_OTAP_IMAGE_CRC              (ERROR_BASE_BLE_NUM + 1) ///< Uploaded image does not match the CRC32 of the begin request
+#define APP_RET_OTAP_ATTEMPTS               (ERROR_BASE_BLE_NUM + 2) ///< Copy of the OTAP buffer into the scratchpad was interrupted too often
+
 #ifdef __cplusplus
 }
 #endif
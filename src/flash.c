@@ -0,0 +1,261 @@
+/* *
+ * Wirepas BLE communication example
+ *
+ * Made in the swiss alps, 2023 <marcel.graber@steinel.ch>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* include global header first */
+#include "app_app.h"
+
+#include "flash.h"
+#define DEBUG_LOG_MODULE_NAME "FLASH"
+#ifdef DEBUG_APP_LOG_MAX_LEVEL
+#define DEBUG_LOG_MAX_LEVEL DEBUG_APP_LOG_MAX_LEVEL
+#else
+#define DEBUG_LOG_MAX_LEVEL LVL_NOLOG
+#endif
+#include "debug_log.h"
+
+/** execution time of the task, it starts or finishes one operation */
+#define FLASH_TASK_EXEC_TIME_US 500
+
+/** external flash reads are mostly done on the bus in startRead(),
+ * take a large timeout that should never be reached */
+#define FLASH_READ_TIMEOUT_US 100000
+
+typedef enum {
+    FLASH_OP_READ = 0,
+    FLASH_OP_WRITE,
+    FLASH_OP_ERASE,
+} flash_op_e;
+
+typedef struct {
+    flash_op_e op;
+    /** read: destination, write: source (copy or caller buffer) */
+    void* buffer;
+    /** offset in the area, sector number for erase */
+    uint32_t address;
+    size_t amount;
+    flash_done_cb_f cb;
+    void* cb_ctx;
+    uint8_t copy[FLASH_WRITE_COPY_LEN];
+} flash_op_t;
+
+static uint32_t m_area_id;
+static app_lib_mem_area_info_t m_info;
+static bool m_initialized = false;
+
+/** ring buffer of the queued operations, the first one is running */
+static flash_op_t m_queue[FLASH_QUEUE_LEN];
+static uint8_t m_head;
+static uint8_t m_count;
+
+/** the first operation is started and not yet done */
+static bool m_running;
+static app_lib_time_timestamp_hp_t m_timeout_end;
+
+/** result of the last operation, which failed, reported by Flash_flush() */
+static int m_error;
+
+static uint32_t flash_task(void);
+
+static int push(const flash_op_t* op) {
+    flash_op_t* entry;
+
+    if (!m_initialized) {
+        return APP_PERSISTENT_RES_UNINITIALIZED;
+    }
+
+    lib_system->enterCriticalSection();
+    if (m_count == FLASH_QUEUE_LEN) {
+        lib_system->exitCriticalSection();
+        return APP_RET_BUSY;
+    }
+    entry = &m_queue[(m_head + m_count) % FLASH_QUEUE_LEN];
+    *entry = *op;
+    if (op->op == FLASH_OP_WRITE && op->amount <= FLASH_WRITE_COPY_LEN) {
+        memcpy(entry->copy, op->buffer, op->amount);
+        entry->buffer = entry->copy;
+    }
+    m_count++;
+    lib_system->exitCriticalSection();
+
+    // nothing happens, if the task is already scheduled
+    App_Scheduler_addTask_execTime(flash_task, APP_SCHEDULER_SCHEDULE_ASAP,
+                                   FLASH_TASK_EXEC_TIME_US);
+    return APP_RET_OK;
+}
+
+/** @brief remove the first operation and tell its result */
+static void complete(int result) {
+    flash_op_t op = m_queue[m_head];
+
+    lib_system->enterCriticalSection();
+    m_head = (m_head + 1) % FLASH_QUEUE_LEN;
+    m_count--;
+    m_running = false;
+    lib_system->exitCriticalSection();
+
+    if (result != APP_RET_OK) {
+        LOG(LVL_ERROR, "op %d at %u failed: %d", op.op, op.address, result);
+        m_error = result;
+    }
+    // the entry may be reused by the callback already
+    if (op.cb != NULL) {
+        op.cb(result, op.cb_ctx);
+    }
+}
+
+/** @brief start the first operation
+ *
+ * @param[out] duration_us expected duration
+ * @return APP_RET_OK or APP_PERSISTENT_RES_FLASH_ERROR
+ */
+static int start(flash_op_t* op, uint32_t* duration_us) {
+    app_lib_mem_area_res_e res;
+    uint32_t timeout_us;
+
+    switch (op->op) {
+    case FLASH_OP_READ:
+        res = lib_memory_area->startRead(m_area_id, op->buffer, op->address, op->amount);
+        // internal flash reads are synchronous
+        *duration_us = 0;
+        timeout_us = m_info.external_flash ? FLASH_READ_TIMEOUT_US : 0;
+        break;
+
+    case FLASH_OP_WRITE:
+        res = lib_memory_area->startWrite(m_area_id, op->address, op->buffer, op->amount);
+        *duration_us = (m_info.flash.byte_write_time + m_info.flash.byte_write_call_time) *
+                       op->amount;
+        timeout_us = *duration_us * 2;
+        break;
+
+    case FLASH_OP_ERASE:
+    default: {
+        uint32_t sector_base = op->address * m_info.flash.erase_sector_size;
+        size_t num_sector = 1;
+
+        res = lib_memory_area->startErase(m_area_id, &sector_base, &num_sector);
+        *duration_us = m_info.flash.sector_erase_time;
+        timeout_us = *duration_us * 2;
+        break;
+    }
+    }
+
+    if (res != APP_LIB_MEM_AREA_RES_OK) {
+        return APP_PERSISTENT_RES_FLASH_ERROR;
+    }
+    m_timeout_end = lib_time->addUsToHpTimestamp(lib_time->getTimestampHp(), timeout_us);
+    return APP_RET_OK;
+}
+
+/** @brief advance the queue by one step
+ *
+ * @return ms till the next step is useful, APP_SCHEDULER_STOP_TASK if idle
+ */
+static uint32_t step(void) {
+    uint32_t duration_us = 0;
+
+    if (m_running) {
+        if (lib_memory_area->isBusy(m_area_id)) {
+            if (lib_time->isHpTimestampBefore(lib_time->getTimestampHp(), m_timeout_end)) {
+                return 1;
+            }
+            complete(APP_PERSISTENT_RES_ACCESS_TIMEOUT);
+        } else {
+            complete(APP_RET_OK);
+        }
+    }
+
+    if (m_count == 0) {
+        return APP_SCHEDULER_STOP_TASK;
+    }
+
+    if (start(&m_queue[m_head], &duration_us) != APP_RET_OK) {
+        complete(APP_PERSISTENT_RES_FLASH_ERROR);
+        return APP_SCHEDULER_SCHEDULE_ASAP;
+    }
+    m_running = true;
+    return duration_us / 1000;
+}
+
+/** @brief App_Scheduler task, runs while operations are queued */
+static uint32_t flash_task(void) {
+    return step();
+}
+
+int Flash_init(uint32_t area_id, app_lib_mem_area_info_t* info) {
+    if (lib_memory_area->getAreaInfo(area_id, &m_info) != APP_LIB_MEM_AREA_RES_OK) {
+        return APP_PERSISTENT_RES_NO_AREA;
+    }
+    m_area_id = area_id;
+    m_initialized = true;
+    *info = m_info;
+    return APP_RET_OK;
+}
+
+int Flash_read(void* to, uint32_t from, size_t amount, flash_done_cb_f cb, void* cb_ctx) {
+    flash_op_t op = {
+        .op = FLASH_OP_READ,
+        .buffer = to,
+        .address = from,
+        .amount = amount,
+        .cb = cb,
+        .cb_ctx = cb_ctx,
+    };
+    return push(&op);
+}
+
+int Flash_write(uint32_t to, const void* from, size_t amount, flash_done_cb_f cb, void* cb_ctx) {
+    flash_op_t op = {
+        .op = FLASH_OP_WRITE,
+        .buffer = (void*)from,
+        .address = to,
+        .amount = amount,
+        .cb = cb,
+        .cb_ctx = cb_ctx,
+    };
+    return push(&op);
+}
+
+int Flash_erase(uint32_t sector, flash_done_cb_f cb, void* cb_ctx) {
+    flash_op_t op = {
+        .op = FLASH_OP_ERASE,
+        .address = sector,
+        .cb = cb,
+        .cb_ctx = cb_ctx,
+    };
+    return push(&op);
+}
+
+bool Flash_isIdle(void) {
+    return m_count == 0;
+}
+
+void Flash_run(void) {
+    step();
+}
+
+int Flash_flush(void) {
+    int ret;
+
+    m_error = APP_RET_OK;
+    while (m_count > 0) {
+        step();
+    }
+    ret = m_error;
+    m_error = APP_RET_OK;
+    return ret;
+}
@@ -0,0 +1,112 @@
+/* *
+ * Wirepas BLE communication example
+ *
+ * Made in the swiss alps, 2023 <marcel.graber@steinel.ch>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    flash.h
+ * @brief   Non blocking access to a memory area
+ *
+ * Operations are queued and executed one after the other in queue order.
+ * An App_Scheduler task starts them and polls lib_memory_area->isBusy(),
+ * so the caller does not wait for the flash. The callback tells the result.
+ *
+ * Everything runs in the application context, callbacks may queue new
+ * operations.
+ */
+#ifndef FLASH_H
+#define FLASH_H
+
+#include "app_app.h"
+
+/** worst case erase time of a sector (nRF52 internal flash, tERASEPAGE) */
+#define FLASH_ERASE_TIME_MS 85
+
+/** fastest stream of queued writes: upload packages of 4 smartphones at the
+ * shortest advertising interval (20 ms) */
+#define FLASH_WRITE_RATE_PER_S 200
+
+/** number of operations, which can be queued
+ *
+ * Writes behind an erase wait for it. The queue holds the writes arriving
+ * till the erase times out (twice the erase time), plus the erase and a few
+ * header writes, so a fast upload does not get APP_RET_BUSY.
+ */
+#define FLASH_QUEUE_LEN (2 * FLASH_ERASE_TIME_MS * FLASH_WRITE_RATE_PER_S / 1000 + 4)
+
+/** writes up to this size are copied into the queue */
+#define FLASH_WRITE_COPY_LEN 32
+
+/** @brief an operation is done
+ *
+ * @param result APP_RET_OK, APP_PERSISTENT_RES_FLASH_ERROR or
+ *        APP_PERSISTENT_RES_ACCESS_TIMEOUT
+ * @param cb_ctx context given when queueing the operation
+ */
+typedef void (*flash_done_cb_f)(int result, void* cb_ctx);
+
+/** @brief use the given memory area
+ *
+ * @param area_id id of the memory area
+ * @param[out] info information about the area
+ * @return APP_RET_OK or APP_PERSISTENT_RES_NO_AREA
+ */
+int Flash_init(uint32_t area_id, app_lib_mem_area_info_t* info);
+
+/** @brief queue a read
+ *
+ * @param to has to stay valid till cb is called
+ * @param cb called when done, can be NULL
+ * @return APP_RET_OK or APP_RET_BUSY if the queue is full
+ */
+int Flash_read(void* to, uint32_t from, size_t amount, flash_done_cb_f cb, void* cb_ctx);
+
+/** @brief queue a write
+ *
+ * @param from copied, if amount is up to FLASH_WRITE_COPY_LEN, otherwise it
+ *        has to stay valid till cb is called
+ * @param cb called when done, can be NULL
+ * @return APP_RET_OK or APP_RET_BUSY if the queue is full
+ */
+int Flash_write(uint32_t to, const void* from, size_t amount, flash_done_cb_f cb, void* cb_ctx);
+
+/** @brief queue the erase of one sector
+ *
+ * @param sector number of the erase sector in the area
+ * @param cb called when done, can be NULL
+ * @return APP_RET_OK or APP_RET_BUSY if the queue is full
+ */
+int Flash_erase(uint32_t sector, flash_done_cb_f cb, void* cb_ctx);
+
+/** @return true if no operation is queued */
+bool Flash_isIdle(void);
+
+/** @brief advance the queue without waiting
+ *
+ * For code running outside of the scheduler (e.g. in App_init()), which
+ * wants to start an operation and do something else meanwhile.
+ */
+void Flash_run(void);
+
+/** @brief wait till all queued operations are done
+ *
+ * Blocks, for the few places, which need the flash content right now.
+ *
+ * @return APP_RET_OK or the first error of the operations done meanwhile
+ */
+int Flash_flush(void);
+
+#endif
@@ -60,6 +60,15 @@ static uint8_t m_lastReceivedPackage[40] = {0};
 /** used to copy incoming ble package and free the caller */
 static uint8_t m_ble_rx_buffer[40] = {0};
 
+/** reassembly of a fragmented message, see ble_adv_cmd_fragment_t */
+static struct {
+    /** index of the next fragment, 0 if no message is pending */
+    uint8_t next;
+    uint8_t len;
+    app_lib_time_timestamp_hp_t last;
+    uint8_t buffer[BLE_FRAGMENT_MAX_LEN];
+} m_fragments;
+
 
 /** @brief add the command to the queue and trigger the task for sending
  *
@@ -80,6 +89,12 @@ static uint32_t bleSendCmd(Ble_context* context, ble_adv_cmd_t* const cmd, uint8
 /** @brief task handles the ble_tx data backlog
  *  @param me reference to the local Ble instance */
 static uint32_t bleSendTask(void* me);
+/** @brief task ends the turbo upload, if the smartphone stopped sending
+ *  @param me reference to the local Ble instance */
+static uint32_t bleOtapTurboTask(void* me);
+/** @brief task answers a page hash request, one response per run
+ *  @param me reference to the local Ble instance */
+static uint32_t bleOtapPageHashTask(void* me);
 /** @} name Tasks */
 /* }}} tasks */
 
@@ -88,6 +103,28 @@ static uint32_t bleSendTask(void* me);
  * -------------------------------------------------------------------------*/
 
 static void bleReceiveCb(const app_lib_beacon_rx_received_t* packet);
+static void bleHandleCmd(ble_adv_cmd_t* cmd_rx, uint8_t cmd_len);
+
+/** session, which a command needs */
+typedef enum {
+    /** handled at any time */
+    ble_SESSION_NONE = 0,
+    /** message id in the current segment of an upload */
+    ble_SESSION_UPLOAD = 1,
+} ble_session_e;
+
+/** @return APP_RET_OK if handled, also if answered with an error, otherwise
+ *          the command is counted as rejected */
+typedef int (*ble_cmd_handler_f)(ble_adv_cmd_t* cmd_rx, uint8_t cmd_len);
+
+/** entry of the dispatch table */
+typedef struct {
+    /** header and the fields the command cannot do without, missing fields
+     * at the end read as 0 */
+    uint8_t min_len;
+    ble_session_e session;
+    ble_cmd_handler_f handler;
+} ble_cmd_entry_t;
 
 /* }}} callbacks / hndler */
 
@@ -141,7 +178,8 @@ static const sm_event_matrix_t m_event_matrix[] = {
 /* {{{ helper
  * ----------------------------------------------------------------------------*/
 /** @brief request new message_id for sending a packet
- * - message ids are valid from 1-16383, see com_adv_cmd_t
+ * - message ids are valid from 1 - BLE_CONTROL_MESSAGE_ID_MAX, the upload
+ *   ids above are never used for sending
  * - in Unit Test mode, the message id will always start by UNIT_TESTS_START_MESSAGE_ID
  *
  * @param[in, out] context current context, will change value message_id
@@ -155,8 +193,8 @@ static uint16_t getNextMessageId(Ble_context* context) {
 
     uint16_t message_id = context->message_id;
 
-    // check if we need to reset the message id
-    if (message_id == 0xffff) {
+    // check if we need to reset the message id, 0 is skipped
+    if (message_id >= BLE_CONTROL_MESSAGE_ID_MAX) {
         message_id = 0;
     }
 
@@ -168,6 +206,450 @@ static uint16_t getNextMessageId(Ble_context* context) {
     return message_id;
 }
 
+/** @brief map the upload flags to the encoding of the stored stream */
+static otap_encoding_e getOtapEncoding(uint8_t flags) {
+    if (flags & ble_OTAP_FLAG_COMPRESSED) {
+        return OTAP_ENCODING_HEATSHRINK;
+    } else if (flags & ble_OTAP_FLAG_DELTA) {
+        return OTAP_ENCODING_DELTA;
+    }
+    return OTAP_ENCODING_RAW;
+}
+
+/** @brief check, if all packages of the journal group in the current segment are received */
+static bool isOtapGroupReceived(Ble_context* context, uint16_t group) {
+    for (int i = group * OTAP_JOURNAL_GROUP_LEN;
+            i < (group + 1) * OTAP_JOURNAL_GROUP_LEN && i < context->otap.segment_messages; i++) {
+        if (!(context->otap.messageReceived[i / 8] & (1 << (i % 8)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** @return first missing package of the current segment from first up to
+ * end (excluded), end if none */
+static uint16_t getOtapFirstMissingIn(Ble_context* context, uint16_t first, uint16_t end) {
+    for (uint16_t i = first; i < end; i++) {
+        if (!(context->otap.messageReceived[i / 8] & (1 << (i % 8)))) {
+            return i;
+        }
+    }
+    return end;
+}
+
+/** @return first missing package of the current segment, segment_messages if none */
+static uint16_t getOtapFirstMissing(Ble_context* context) {
+    return getOtapFirstMissingIn(context, 0, context->otap.segment_messages);
+}
+
+/** @return first package of source in the current segment, when the
+ * segment is shared evenly, segment_messages for source num_sources */
+static uint16_t getOtapSourceStart(Ble_context* context, uint8_t source) {
+    if (source >= context->otap.num_sources) {
+        return context->otap.segment_messages;
+    }
+    return (uint32_t)context->otap.segment_messages * source / context->otap.num_sources /
+           OTAP_JOURNAL_GROUP_LEN * OTAP_JOURNAL_GROUP_LEN;
+}
+
+/** @return source sending the given package of the current segment */
+static uint8_t getOtapSource(Ble_context* context, uint16_t package) {
+    for (uint8_t i = 0; i < context->otap.num_sources; i++) {
+        if (package >= context->otap.sources[i].first && package < context->otap.sources[i].end) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/** @brief ble_OTAP_FLAG_MULTI_SOURCE: the new source takes over the upper
+ * half of the largest range, which is still to be sent
+ *
+ * @return APP_RET_OK or APP_RET_RESOURCES, if there is nothing to share
+ */
+static int addOtapSource(Ble_context* context, uint16_t token) {
+    ble_otap_source_t* donor = NULL;
+    uint16_t donor_missing = 0;
+    uint16_t split;
+
+    if (context->otap.num_sources == BLE_OTAP_MAX_SOURCES) {
+        return APP_RET_RESOURCES;
+    }
+
+    for (uint8_t i = 0; i < context->otap.num_sources; i++) {
+        ble_otap_source_t* source = &context->otap.sources[i];
+        uint16_t missing = getOtapFirstMissingIn(context, source->first, source->end);
+
+        if (donor == NULL || source->end - missing > donor->end - donor_missing) {
+            donor = source;
+            donor_missing = missing;
+        }
+    }
+    if (donor == NULL) {
+        return APP_RET_RESOURCES;
+    }
+
+    // journal groups are not shared
+    split = donor_missing + (donor->end - donor_missing) / 2;
+    split = (split + OTAP_JOURNAL_GROUP_LEN - 1) / OTAP_JOURNAL_GROUP_LEN * OTAP_JOURNAL_GROUP_LEN;
+    if (split >= donor->end) {
+        return APP_RET_RESOURCES;
+    }
+
+    context->otap.sources[context->otap.num_sources] = (ble_otap_source_t) {
+        .token = token,
+        .first = split,
+        .end = donor->end,
+    };
+    context->otap.num_sources++;
+    donor->end = split;
+    return APP_RET_OK;
+}
+
+/** @return true, if the begin request asks for compact data frames */
+static bool isOtapCompact(Ble_context* context, const ble_adv_cmd_otap_begin_upload_req_t* req) {
+    return (req->package_length & BLE_OTAP_PACKAGE_COMPACT) != 0 ||
+           (context->capabilities & ble_CAP_COMPACT);
+}
+
+/** @return true, if the begin request joins the running multi-source upload */
+static bool isOtapJoin(Ble_context* context, const ble_adv_cmd_otap_begin_upload_req_t* req) {
+    uint32_t stream_length = (req->flags & (ble_OTAP_FLAG_COMPRESSED | ble_OTAP_FLAG_DELTA)) ?
+                             req->stream_length : req->scratchpad_length;
+
+    return (req->flags & ble_OTAP_FLAG_MULTI_SOURCE) &&
+           context->otap.end_message_id != 0 &&
+           req->flags == context->otap.flags &&
+           req->scratchpad_sequence_number == context->otap.scratchpad_seqeunce_number &&
+           req->scratchpad_length == context->otap.scratchpad_length &&
+           (req->package_length & ~BLE_OTAP_PACKAGE_COMPACT) == context->otap.requested_package_length &&
+           stream_length == context->otap.stream_length &&
+           req->image_crc == context->otap.image_crc;
+}
+
+/** @brief switch the receive state to the given segment
+ *
+ * packages journaled or in kept pages are marked received
+ */
+static void startOtapSegment(Ble_context* context, uint16_t segment) {
+    uint32_t first = (uint32_t)segment * BLE_OTAP_SEGMENT_PACKAGES;
+
+    context->otap.segment = segment;
+    context->otap.segment_checked = false;
+    context->otap.segment_messages = (context->otap.total_messages - first) > BLE_OTAP_SEGMENT_PACKAGES ?
+                                     BLE_OTAP_SEGMENT_PACKAGES : context->otap.total_messages - first;
+    context->otap.start_message_id = BLE_OTAP_FIRST_MESSAGE_ID +
+                                     (segment % BLE_OTAP_SEGMENT_ID_RANGES) * BLE_OTAP_SEGMENT_PACKAGES;
+    context->otap.end_message_id = context->otap.start_message_id + context->otap.segment_messages - 1;
+
+    // the sources share the new segment evenly
+    for (uint8_t i = 0; i < context->otap.num_sources; i++) {
+        context->otap.sources[i].first = getOtapSourceStart(context, i);
+        context->otap.sources[i].end = getOtapSourceStart(context, i + 1);
+    }
+
+    memset(context->otap.messageReceived, 0, sizeof(context->otap.messageReceived));
+    Otap_bufferReceived(first, context->otap.messageReceived, context->otap.segment_messages);
+    for (uint16_t i = 0; i < context->otap.segment_messages; i++) {
+        if (Otap_isKept((first + i) * context->otap.adv_package_length,
+                        context->otap.adv_package_length)) {
+            context->otap.messageReceived[i / 8] |= 1 << (i % 8);
+        }
+    }
+}
+
+/** @brief copy a 128-bit UUID, it is sent in reversed byte order */
+static void reverseUuid(uint8_t* to, const uint8_t* from) {
+    uint32_t words[4];
+
+    // word by word, the input is not aligned
+    memcpy(words, from, sizeof(words));
+    for (uint8_t i = 0; i < 4; i++) {
+        uint32_t word = __builtin_bswap32(words[3 - i]);
+        memcpy(to + 4 * i, &word, sizeof(word));
+    }
+}
+
+/** @brief collect the frame of an iOS advertisement, see ble_rx_header_service_t
+ *
+ * Any device advertising a 128-bit UUID reaches this point, only the layout
+ * of the app is taken: one AD structure with a single UUID, the local name
+ * up to BLE_IOS_EXTENDED_FRAME_LEN - BLE_IOS_FRAME_LEN bytes and short
+ * structures (flags, tx power) which are skipped.
+ *
+ * @param[out] buffer frame, up to BLE_IOS_EXTENDED_FRAME_LEN bytes
+ * @return frame length, 0 if the advertisement is not an iOS frame
+ */
+static uint8_t getIosFrame(const app_lib_beacon_rx_received_t* packet, uint8_t* buffer) {
+    const uint8_t* uuid = NULL;
+    const uint8_t* name = NULL;
+    uint8_t name_len = 0;
+
+    // AD structures (length, type, data) behind the mac address
+    for (uint8_t pos = 6; pos + 1 < packet->length; ) {
+        uint8_t ad_len = packet->payload[pos];
+        uint8_t ad_type = packet->payload[pos + 1];
+        const uint8_t* data = packet->payload + pos + 2;
+
+        if (ad_len == 0 || pos + 1 + ad_len > packet->length) {
+            return 0;
+        }
+        if (ad_type == BLE_ADV_DATA_TYPE_SERVICE_UUID ||
+                ad_type == BLE_ADV_DATA_TYPE_SERVICE_UUID_INCOMPLETE) {
+            if (uuid != NULL || ad_len != 1 + BLE_IOS_FRAME_LEN) {
+                return 0;
+            }
+            uuid = data;
+        } else if (ad_type == BLE_ADV_DATA_TYPE_LOCAL_NAME ||
+                   ad_type == BLE_ADV_DATA_TYPE_LOCAL_NAME_SHORT) {
+            if (name != NULL || ad_len - 1 > BLE_IOS_EXTENDED_FRAME_LEN - BLE_IOS_FRAME_LEN) {
+                return 0;
+            }
+            name = data;
+            name_len = ad_len - 1;
+        } else if (ad_len > 3) {
+            // data of another device
+            return 0;
+        }
+        pos += 1 + ad_len;
+    }
+
+    if (uuid == NULL) {
+        return 0;
+    }
+    reverseUuid(buffer, uuid);
+    // the name continues the frame, whatever the AD order is
+    if (name != NULL) {
+        memcpy(buffer + BLE_IOS_FRAME_LEN, name, name_len);
+    }
+    return BLE_IOS_FRAME_LEN + name_len;
+}
+
+/** @brief distance of two control message ids, serial number arithmetic
+ *
+ * The ids wrap from BLE_CONTROL_MESSAGE_ID_MAX to 1.
+ *
+ * @return a - b, positive if a is newer than b
+ */
+static int16_t getMessageIdDistance(uint16_t a, uint16_t b) {
+    int32_t diff = ((int32_t)a - b + BLE_CONTROL_MESSAGE_ID_MAX) % BLE_CONTROL_MESSAGE_ID_MAX;
+
+    if (diff > BLE_CONTROL_MESSAGE_ID_MAX / 2) {
+        diff -= BLE_CONTROL_MESSAGE_ID_MAX;
+    }
+    return (int16_t)diff;
+}
+
+/** @brief the frame was handled already
+ *
+ * Control messages and upload packages are tracked on their own, so a
+ * package between the repetitions of a request does not let the request
+ * through again. Control ids are counted up, a request not newer than the
+ * last one is stale (serial number arithmetic). The scan request is never
+ * suppressed, it starts the ids over.
+ * Upload packages are resent out of order, a package of the current
+ * segment is a repetition, if it was received already. The last package of
+ * a range is let through again, it triggers the completion check.
+ */
+static bool isRepeated(Ble_context* context, const ble_adv_cmd_t* cmd) {
+    if (cmd->message_id & BLE_OTAP_FIRST_MESSAGE_ID) {
+        if (cmd->message_id == context->last_received_data_id) {
+            return true;
+        }
+        if (context->otap.end_message_id == 0 ||
+                cmd->message_id < context->otap.start_message_id ||
+                cmd->message_id > context->otap.end_message_id) {
+            // not part of the upload, rejected by bleHandleCmd()
+            return false;
+        }
+        uint16_t package = cmd->message_id - context->otap.start_message_id;
+        return (context->otap.messageReceived[package / 8] & (1 << (package % 8))) &&
+               package + 1 != context->otap.sources[getOtapSource(context, package)].end;
+    }
+    if (cmd->command == ble_ADV_CMD_SCAN_REQUEST) {
+        return false;
+    }
+    // 0 is no valid control id
+    if (cmd->message_id == 0) {
+        return true;
+    }
+    return context->last_received_message_id != 0 &&
+           getMessageIdDistance(cmd->message_id, context->last_received_message_id) <= 0;
+}
+
+/** @brief link quality of the frames from the smartphone
+ *
+ * requests are numbered one after the other, gaps are lost requests. Upload
+ * packages are counted per segment. The scan request starts over.
+ */
+static void updateLink(Ble_context* context, int8_t rssi, const ble_adv_cmd_t* cmd) {
+    uint16_t last = context->last_received_message_id;
+    uint16_t message_id = cmd->message_id;
+
+    if (cmd->command == ble_ADV_CMD_SCAN_REQUEST) {
+        context->link_rssi = rssi;
+        context->link_received = 1;
+        context->link_lost = 0;
+        return;
+    }
+    context->link_rssi = (3 * context->link_rssi + rssi) / 4;
+    if (message_id >= BLE_OTAP_FIRST_MESSAGE_ID) {
+        return;
+    }
+    context->link_received++;
+    if (last != 0 && getMessageIdDistance(message_id, last) > 1) {
+        context->link_lost += getMessageIdDistance(message_id, last) - 1;
+    }
+}
+
+/** @return lost requests since the scan request, per mille */
+static uint16_t getLinkLoss(Ble_context* context) {
+    uint32_t total = context->link_received + context->link_lost;
+
+    return total > 0 ? context->link_lost * 1000 / total : 0;
+}
+
+/** @brief recommend how often every package is sent on the link
+ *
+ * @param loss lost frames, per mille
+ * @return 1 on good links, up to 3 on marginal ones
+ */
+static uint8_t recommendOtapRepeat(Ble_context* context, uint16_t loss) {
+    if (context->link_rssi >= BLE_LINK_RSSI_GOOD && loss < BLE_LINK_LOSS_GOOD) {
+        return 1;
+    } else if (context->link_rssi >= BLE_LINK_RSSI_FAIR && loss < BLE_LINK_LOSS_FAIR) {
+        return 2;
+    }
+    return 3;
+}
+
+/** @brief recommend the package length and repeat count for the link
+ *
+ * Good links use the full length. On marginal ones, shorter packages are
+ * sent repeatedly, so less of them are lost.
+ *
+ * @param max_length largest package length of the smartphone
+ * @param loss lost frames, per mille
+ */
+static void recommendOtapLink(Ble_context* context, uint8_t max_length, uint16_t loss,
+                              uint8_t* package_length, uint8_t* repeat_count) {
+    uint8_t length = max_length;
+
+    *repeat_count = recommendOtapRepeat(context, loss);
+    if (*repeat_count == 2) {
+        length = max_length * 3 / 4;
+    } else if (*repeat_count > 2) {
+        length = max_length / 2;
+    }
+
+    // the buffer journal is sized for the smallest packages
+    if (length < OTAP_MIN_PACKAGE_LENGTH) {
+        length = max_length < OTAP_MIN_PACKAGE_LENGTH ? max_length : OTAP_MIN_PACKAGE_LENGTH;
+    }
+    *package_length = length;
+}
+
+/** @brief largest package length of an upload, which fits into a frame of
+ * the smartphone
+ *
+ * @param compact the packages are sent in compact data frames
+ */
+static uint8_t getMaxPackageLength(Ble_context* context, bool compact) {
+    uint8_t frame_len = context->max_frame_len > 0 ? context->max_frame_len : BLE_ADV_TOTAL_LEN;
+    uint8_t length = frame_len - (compact ? BLE_ADV_DATA_HEADER_LEN : BLE_ADV_HEADER_LEN);
+
+    return length < OTAP_DIRECT_PACKAGE_LEN ? length : OTAP_DIRECT_PACKAGE_LEN;
+}
+
+/** @brief token of this node, for simplicity the Nordic Unique ID */
+static uint16_t getNodeToken(void) {
+    return (uint16_t)(getUniqueAddress() & 0xFFFF);
+}
+
+/** @brief multicast upload: report the missing packages of the segment
+ *
+ * The smartphone collects the reports of all nodes and resends the union,
+ * nothing waits for an answer.
+ * @param first_missing first missing package in the segment
+ */
+static void sendOtapNack(Ble_context* context, uint16_t first_missing) {
+    ble_adv_cmd_t cmd = {
+        .message_id = getNextMessageId(context),
+        .command = ble_ADV_CMD_OTAP_NACK_RESPONSE,
+        .payload.otap_nack_rsp.transfer_id = context->otap.transfer_id,
+        .payload.otap_nack_rsp.node_token = getNodeToken(),
+        .payload.otap_nack_rsp.segment = context->otap.segment,
+        .payload.otap_nack_rsp.first_message_id = context->otap.start_message_id + first_missing,
+    };
+
+    for (uint16_t i = 0; i < BLE_OTAP_NACK_PACKAGES &&
+            first_missing + i < context->otap.segment_messages; i++) {
+        uint16_t package = first_missing + i;
+        if (!(context->otap.messageReceived[package / 8] & (1 << (package % 8)))) {
+            cmd.payload.otap_nack_rsp.missing[i / 8] |= 1 << (i % 8);
+        }
+    }
+    bleSendCmd(context, &cmd, BLE_ADV_CMD_OTAP_NACK_RSP_LEN, 0);
+}
+
+/** @brief log the packages per second of the upload, to compare the modes */
+static void logOtapThroughput(Ble_context* context) {
+    int64_t duration_s = lib_time->getTimestampS() - context->otap.begin_s;
+
+    LOG(LVL_INFO, "otap upload: %u packages in %u s, %u packages/s, turbo: %d",
+        context->otap.received_packages, (uint32_t)duration_s,
+        duration_s > 0 ? (uint32_t)(context->otap.received_packages / duration_s) :
+        context->otap.received_packages,
+        context->otap.turbo);
+}
+
+/** @brief ble_OTAP_FLAG_TURBO: stop the stack, so the scanner is not
+ * interrupted by the mesh schedule
+ *
+ * Relies on lib_state->stopStack() returning with the app still running,
+ * see Otap_directBegin(). If the stack cannot be stopped, the upload goes
+ * on with the stack running.
+ *
+ * @return APP_RET_OK or APP_RET_INVALID_STATE, if the stack cannot be stopped
+ */
+static int startOtapTurbo(Ble_context* context) {
+    if (lib_state->getStackState() == APP_LIB_STATE_STARTED &&
+            lib_state->stopStack() != APP_RES_OK) {
+        LOG(LVL_ERROR, "cannot stop stack");
+        return APP_RET_INVALID_STATE;
+    }
+
+    // scan again, now on all channels without gaps
+    lib_beacon_rx->stopScanner();
+    if (lib_beacon_rx->startScanner(APP_LIB_BEACON_RX_CHANNEL_ALL) != APP_RES_OK) {
+        LOG(LVL_ERROR, "Cannot start scanner");
+    }
+
+    context->otap.turbo = true;
+    context->otap.last_package_s = lib_time->getTimestampS();
+    if (App_Scheduler_addTask_execTime_Caller(bleOtapTurboTask, context,
+            1000, 10) != APP_SCHEDULER_RES_OK) {
+        LOG(LVL_ERROR, "Cannot start turbo timeout task");
+    }
+    LOG(LVL_INFO, "otap turbo started");
+    return APP_RET_OK;
+}
+
+/** @brief ble_OTAP_FLAG_TURBO: start the stack again, without a reboot */
+static void stopOtapTurbo(Ble_context* context) {
+    if (!context->otap.turbo) {
+        return;
+    }
+    context->otap.turbo = false;
+
+    if (lib_state->getStackState() != APP_LIB_STATE_STARTED &&
+            lib_state->startStack() != APP_RES_OK) {
+        LOG(LVL_ERROR, "Failure in starting stack");
+    }
+    LOG(LVL_INFO, "otap turbo stopped");
+}
+
 static uint32_t getBufferFromCmd(
     ble_adv_cmd_t* const cmd,
     uint8_t* buffer,
@@ -276,7 +758,7 @@ static uint32_t bleSendCmd(Ble_context* context, ble_adv_cmd_t* const cmd, uint8
 static void configureLibBeaconTx() {
 
     lib_beacon_tx->clearBeacons();
-    lib_beacon_tx->setBeaconInterval(100); // from 100ms to 60 seconds
+    lib_beacon_tx->setBeaconInterval(BLE_TX_INTERVAL_MS); // from 100ms to 60 seconds
     int8_t power = 8;                      // 8 dBm
     lib_beacon_tx->setBeaconPower(0, &power);
     lib_beacon_tx->setBeaconChannels(0, APP_LIB_BEACON_TX_CHANNELS_ALL); // All channels
@@ -340,6 +822,62 @@ static void scanningStop(void* context_p) {
  * ----------------------------------------------------------------------------*/
 
 
+/** @brief collect the fragments of a message
+ *
+ * Fragments are taken in order only. A gap or a pause longer than
+ * BLE_FRAGMENT_TIMEOUT_MS drops the pending message, the smartphone sends it
+ * again.
+ *
+ * @param[in,out] len length of the fragment, of the message when complete
+ * @return the complete message, NULL while incomplete or dropped
+ */
+static ble_adv_cmd_t* reassembleFragment(const ble_adv_cmd_t* cmd, uint8_t* len) {
+    uint8_t index = cmd->payload.fragment.fragment & BLE_FRAGMENT_INDEX_MASK;
+    bool last = (cmd->payload.fragment.fragment & BLE_FRAGMENT_LAST) != 0;
+    app_lib_time_timestamp_hp_t now = lib_time->getTimestampHp();
+    uint8_t data_len;
+
+    if (*len <= BLE_ADV_HEADER_LEN + 1) {
+        return NULL;
+    }
+    data_len = *len - BLE_ADV_HEADER_LEN - 1;
+
+    if (m_fragments.next > 0 &&
+            lib_time->getTimeDiffUs(now, m_fragments.last) > BLE_FRAGMENT_TIMEOUT_MS * 1000) {
+        LOG(LVL_DEBUG, "fragment timeout, drop %d bytes", m_fragments.len);
+        m_fragments.next = 0;
+    }
+    // fragment 0 starts a new message, also over a pending one
+    if (index == 0) {
+        m_fragments.next = 0;
+        m_fragments.len = 0;
+        // a short message must not see the bytes of an earlier one
+        memset(m_fragments.buffer, 0, sizeof(m_fragments.buffer));
+    }
+    if (index != m_fragments.next || m_fragments.len + data_len > BLE_FRAGMENT_MAX_LEN) {
+        LOG(LVL_DEBUG, "fragment %d unexpected, drop message", index);
+        m_fragments.next = 0;
+        return NULL;
+    }
+
+    memcpy(m_fragments.buffer + m_fragments.len, cmd->payload.fragment.data, data_len);
+    m_fragments.len += data_len;
+    m_fragments.next++;
+    m_fragments.last = now;
+    if (!last) {
+        return NULL;
+    }
+
+    m_fragments.next = 0;
+    cmd = (const ble_adv_cmd_t*)m_fragments.buffer;
+    // no fragments in fragments
+    if (m_fragments.len <= BLE_ADV_HEADER_LEN || cmd->command == ble_ADV_CMD_FRAGMENT_REQUEST) {
+        return NULL;
+    }
+    *len = m_fragments.len;
+    return (ble_adv_cmd_t*)m_fragments.buffer;
+}
+
 /** @brief this callback will be called from lib_beacon_rx, when a new package arrives
  *
  * @param packet the format in packet->payload includes the mac-address in front (6 bytes)
@@ -352,8 +890,8 @@ static void bleReceiveCb(const app_lib_beacon_rx_received_t* packet) {
     //
     // Android package, ad_data_type = 0xFF and the company id for steinel solutions has to be set
     //
-    // IOS package, the data has fixed length  mac(6 Byte) / ad_data_len(1 Byte) / ad_data_type (1 Byte) / UUID (16 Byte)
-    // and ad_data_len = 16  and ad_data_type = 0x07
+    // IOS package, one 128-bit service UUID (ad_data_type = 0x07) and the local name,
+    // see getIosFrame()
     if (packet->length > 10 && packet->payload[7] == BLE_ADV_DATA_TYPE_MANUFACTURER &&
             packet->payload[8] == ((uint8_t)(BLE_COMPANY_ID) & 0xFF)
             && packet->payload[9] == ((uint8_t)(BLE_COMPANY_ID >> 8) & 0xFF)
@@ -361,23 +899,17 @@ static void bleReceiveCb(const app_lib_beacon_rx_received_t* packet) {
         // this package is interesting, keep on going
         // set buffer to correct address
         uint8_t offset = + 6 + 2 + 2; // mac address (6) ad_data_len (1) ad_data_type(1) company_id (2)
+        // fields not sent by older apps read as 0
+        memset(m_ble_rx_buffer, 0, sizeof(m_ble_rx_buffer));
         memcpy(m_ble_rx_buffer, packet->payload + offset, packet->length - offset);
         buffer_len = packet->length - offset; // same here
-    } else if (packet->length == 30 && packet->payload[13] == BLE_ADV_DATA_TYPE_SERVICE_UUID) {
-        /* LOG(LVL_INFO, "IOS package: %d", packet->length); */
-        /* LOG_BUFFER(LVL_INFO, packet->payload, packet->length); */
-        uint8_t offset = + 6 + 2 +
-                         6; // mac address (6) + ad_data_len (1) ad_data_type(1) + ios sends two flags (2x3 Bytes)?? */
-
-        for (uint8_t i = 0; i < 16; i++) {
-            m_ble_rx_buffer[i] = packet->payload[packet->length - 1 - i];
-        }
-
-        /* buffer = packet->payload + offset; */
-        buffer_len = packet->length - offset;
-        /* buffer_len = 6; */
     } else {
-        return;
+        // IOS package, service UUIDs and local name
+        memset(m_ble_rx_buffer, 0, sizeof(m_ble_rx_buffer));
+        buffer_len = getIosFrame(packet, m_ble_rx_buffer);
+        if (buffer_len == 0) {
+            return;
+        }
     }
 
     // nothing to do, if com_context is not set
@@ -398,157 +930,773 @@ static void bleReceiveCb(const app_lib_beacon_rx_received_t* packet) {
     // set this package as last received
     memcpy(m_lastReceivedPackage, m_ble_rx_buffer, buffer_len);
 
-    // check if the address matches
-    if ( m_ble_context_p->last_received_message_id == cmd_rx->message_id &&
-            cmd_rx->message_id > 1) {
+    // compact data frame, insert the implied command, the buffer has room
+    if (m_ble_context_p->otap.compact && (cmd_rx->message_id & BLE_OTAP_FIRST_MESSAGE_ID)) {
+        memmove(m_ble_rx_buffer + BLE_ADV_HEADER_LEN, m_ble_rx_buffer + BLE_ADV_DATA_HEADER_LEN,
+                buffer_len - BLE_ADV_DATA_HEADER_LEN);
+        cmd_rx->command = ble_ADV_CMD_OTAP_UPLOAD_REQUEST;
+        buffer_len++;
+    }
+
+    if (isRepeated(m_ble_context_p, cmd_rx)) {
         // same package, ignore
         return;
     }
-    m_ble_context_p->last_received_message_id = cmd_rx->message_id;
+    updateLink(m_ble_context_p, packet->rssi, cmd_rx);
+    if (cmd_rx->message_id & BLE_OTAP_FIRST_MESSAGE_ID) {
+        m_ble_context_p->last_received_data_id = cmd_rx->message_id;
+    } else {
+        m_ble_context_p->last_received_message_id = cmd_rx->message_id;
+    }
+
+    // a message larger than one advertisement, handled when complete
+    if (cmd_rx->command == ble_ADV_CMD_FRAGMENT_REQUEST) {
+        cmd_rx = reassembleFragment(cmd_rx, &buffer_len);
+        if (cmd_rx == NULL) {
+            return;
+        }
+    }
+    bleHandleCmd(cmd_rx, buffer_len);
+}
 
-    if (cmd_rx->command == (ble_ADV_CMD_SCAN_REQUEST)) {
-        // for simplicity just use the Nordic Unique ID
-        m_ble_context_p->connected_token = (getUniqueAddress() & 0xFFFF);
-        LOG(LVL_INFO, "Scan request Msg: %d, token: %d", cmd_rx->message_id, m_ble_context_p->connected_token);
+/** @brief start of a connection, agree on the capabilities */
+static int handleScanRequest(ble_adv_cmd_t* cmd_rx, uint8_t cmd_len) {
+    m_ble_context_p->connected_token = getNodeToken();
+    m_ble_context_p->last_received_data_id = 0;
+    // older apps send no capabilities and get the basic protocol
+    m_ble_context_p->capabilities = cmd_rx->payload.scan_req.capabilities & BLE_CAPABILITIES;
+    m_ble_context_p->max_frame_len = BLE_ADV_TOTAL_LEN;
+    if (cmd_rx->payload.scan_req.hardware == BLE_HARDWARE_IOS) {
+        m_ble_context_p->max_frame_len = (m_ble_context_p->capabilities & ble_CAP_IOS_EXTENDED) ?
+                                         BLE_IOS_EXTENDED_FRAME_LEN : BLE_IOS_FRAME_LEN;
+    }
+    LOG(LVL_INFO, "Scan request Msg: %d, token: %d", cmd_rx->message_id, m_ble_context_p->connected_token);
+    ble_adv_cmd_t cmd_rsp = {
+        .message_id =  getNextMessageId(m_ble_context_p),
+        .command = ble_ADV_CMD_SCAN_RESPONSE,
+        .payload.scan_rsp.request_id = cmd_rx->message_id,
+        .payload.scan_rsp.token = m_ble_context_p->connected_token,
+        .payload.scan_rsp.firmware_version_major = VER_MAJOR,
+        .payload.scan_rsp.firmware_version_minor = VER_MINOR,
+        .payload.scan_rsp.is_sink = m_ble_context_p->app_settings_p->is_sink,
+        .payload.scan_rsp.capabilities = m_ble_context_p->capabilities,
+        .payload.scan_rsp.max_package_length = getMaxPackageLength(m_ble_context_p,
+                (m_ble_context_p->capabilities & ble_CAP_COMPACT) != 0),
+        .payload.scan_rsp.tx_interval_ms = BLE_TX_INTERVAL_MS,
+        .payload.scan_rsp.tx_dwell_ms = BLE_TX_DWELL_MS,
+    };
+
+    bleSendCmd(m_ble_context_p, &cmd_rsp, BLE_ADV_CMD_SCAN_RSP_LEN, 0);
+    Sm_fireEvent(m_ble_context_p->sm_context_p, ble_E_CONNECTING_START, 500);
+    return APP_RET_OK;
+}
+
+/** @brief count the round trip time of the pong echoed by a ping */
+static void addProbeRtt(Ble_context* context, const ble_adv_cmd_probe_req_t* req) {
+    uint32_t rtt_ms;
+    uint8_t bucket = 0;
+
+    if (req->node_time == 0) {
+        return;
+    }
+    // without the time the pong waited on the smartphone
+    rtt_ms = lib_time->getTimeDiffUs(lib_time->getTimestampHp(), req->node_time) / 1000;
+    rtt_ms = rtt_ms > req->hold_ms ? rtt_ms - req->hold_ms : 0;
+    while (bucket < BLE_PROBE_RTT_BUCKETS - 1 && rtt_ms > ((uint32_t)BLE_PROBE_RTT_FIRST_MS << bucket)) {
+        bucket++;
+    }
+    if (context->probe.rtt[bucket] < UINT8_MAX) {
+        context->probe.rtt[bucket]++;
+    }
+}
+
+/** @brief count a dummy chunk of the bulk mode, nothing is written */
+static void addProbeChunk(Ble_context* context, const ble_adv_cmd_probe_req_t* req, uint8_t data_len) {
+    ble_probe_t* probe = &context->probe;
+    uint16_t sequence = req->sequence;
+    app_lib_time_timestamp_hp_t now = lib_time->getTimestampHp();
+
+    if (sequence >= BLE_PROBE_CHUNKS) {
+        return;
+    }
+    if (probe->chunks[sequence / 8] & (1 << (sequence % 8))) {
+        probe->duplicates++;
+        return;
+    }
+    probe->chunks[sequence / 8] |= 1 << (sequence % 8);
+    if (probe->received == 0) {
+        probe->first = now;
+    }
+    probe->received++;
+    probe->bytes += data_len;
+    probe->last = now;
+    if (sequence >= probe->end) {
+        probe->end = sequence + 1;
+    }
+}
+
+/** @brief send the statistics of the link probe */
+static void sendProbeReport(Ble_context* context, uint16_t request_id, uint8_t mode) {
+    ble_probe_t* probe = &context->probe;
+    uint32_t duration_us = lib_time->getTimeDiffUs(probe->last, probe->first);
+    ble_adv_cmd_t cmd_rsp = {
+        .message_id = getNextMessageId(context),
+        .command = ble_ADV_CMD_PROBE_RESPONSE,
+        .payload.probe_report_rsp.request_id = request_id,
+        .payload.probe_report_rsp.mode = mode,
+        .payload.probe_report_rsp.received = probe->received,
+        .payload.probe_report_rsp.lost = probe->end - probe->received,
+        .payload.probe_report_rsp.duplicates = probe->duplicates,
+        .payload.probe_report_rsp.goodput = duration_us > 0 ?
+                                            (uint32_t)((uint64_t)probe->bytes * 1000000 / duration_us) : 0,
+    };
+
+    memcpy(cmd_rsp.payload.probe_report_rsp.rtt, probe->rtt, sizeof(probe->rtt));
+    LOG(LVL_INFO, "Probe: %d chunks, %d lost, %d duplicates, %u bytes/s", probe->received,
+        probe->end - probe->received, probe->duplicates, cmd_rsp.payload.probe_report_rsp.goodput);
+    bleSendCmd(context, &cmd_rsp, BLE_ADV_CMD_PROBE_REPORT_RSP_LEN, 0);
+}
+
+/** @brief link probe, measures the advertising link without the flash */
+static int handleProbe(ble_adv_cmd_t* cmd_rx, uint8_t cmd_len) {
+    const ble_adv_cmd_probe_req_t* req = &cmd_rx->payload.probe_req;
+
+    switch (req->mode) {
+    case ble_PROBE_PING: {
         ble_adv_cmd_t cmd_rsp = {
-            .message_id =  getNextMessageId(m_ble_context_p),
-            .command = ble_ADV_CMD_SCAN_RESPONSE,
-            .payload.scan_rsp.request_id = cmd_rx->message_id,
-            .payload.scan_rsp.token = m_ble_context_p->connected_token,
-            .payload.scan_rsp.firmware_version_major = VER_MAJOR,
-            .payload.scan_rsp.firmware_version_minor = VER_MINOR,
-            .payload.scan_rsp.is_sink = m_ble_context_p->app_settings_p->is_sink
+            .message_id = getNextMessageId(m_ble_context_p),
+            .command = ble_ADV_CMD_PROBE_RESPONSE,
+            .payload.probe_pong_rsp.request_id = cmd_rx->message_id,
+            .payload.probe_pong_rsp.mode = ble_PROBE_PING,
+            .payload.probe_pong_rsp.sequence = req->sequence,
+            .payload.probe_pong_rsp.phone_time = req->phone_time,
+            .payload.probe_pong_rsp.node_time = lib_time->getTimestampHp(),
         };
 
-        bleSendCmd(m_ble_context_p, &cmd_rsp, BLE_ADV_CMD_SCAN_RSP_LEN, 0);
-        Sm_fireEvent(m_ble_context_p->sm_context_p, ble_E_CONNECTING_START, 500);
-        return;
+        addProbeRtt(m_ble_context_p, req);
+        bleSendCmd(m_ble_context_p, &cmd_rsp, BLE_ADV_CMD_PROBE_PONG_RSP_LEN, 0);
+        break;
+    }
+    case ble_PROBE_RESET:
+        memset(&m_ble_context_p->probe, 0, sizeof(m_ble_context_p->probe));
+        sendProbeReport(m_ble_context_p, cmd_rx->message_id, req->mode);
+        break;
+    case ble_PROBE_CHUNK:
+        addProbeChunk(m_ble_context_p, req, cmd_len - BLE_ADV_CMD_PROBE_MIN_LEN);
+        break;
+    case ble_PROBE_REPORT:
+        sendProbeReport(m_ble_context_p, cmd_rx->message_id, req->mode);
+        break;
+    default:
+        LOG(LVL_DEBUG, "unknown probe mode: %d", req->mode);
+        break;
+    }
+    return APP_RET_OK;
+}
 
-    } else if (cmd_rx->command == (ble_ADV_CMD_OTAP_BEGIN_UPLOAD_REQUEST)) {
-        LOG(LVL_INFO, "OTAP Begin Upload Msg: %d", cmd_rx->message_id);
-        m_ble_context_p->otap.adv_package_length = cmd_rx->payload.otap_begin_upload_req.package_length;
-        m_ble_context_p->otap.scratchpad_length = cmd_rx->payload.otap_begin_upload_req.scratchpad_length;
-        m_ble_context_p->otap.scratchpad_seqeunce_number = cmd_rx->payload.otap_begin_upload_req.scratchpad_sequence_number;
-        // use fileupload partition (message_id 0x8000 - 0xFFFF)
-        m_ble_context_p->otap.start_message_id = 0x8000;
-        m_ble_context_p->otap.end_message_id = m_ble_context_p->otap.start_message_id +
-                                               m_ble_context_p->otap.scratchpad_length / m_ble_context_p->otap.adv_package_length +
-                                               (m_ble_context_p->otap.scratchpad_length % m_ble_context_p->otap.adv_package_length ? 1 : 0) - 1;
-        m_ble_context_p->otap.total_messages = m_ble_context_p->otap.end_message_id - m_ble_context_p->otap.start_message_id + 1;
-        // set received message flags
-        memset(m_ble_context_p->otap.messageReceived,0, sizeof(m_ble_context_p->otap.messageReceived));
-
-        // check if settings are ok
-        int ret = Otap_init();
+/** @brief a further smartphone joins the running upload, ble_OTAP_FLAG_MULTI_SOURCE */
+static void handleOtapJoinUpload(ble_adv_cmd_t* cmd_rx, uint8_t cmd_len) {
+    uint16_t token = cmd_rx->payload.otap_begin_upload_req.token;
+    uint8_t source = 0;
+    int ret = APP_RET_OK;
 
-        if (ret != APP_RET_OK) {
-            LOG(LVL_ERROR, "Otap_init failed: %d", ret);
+    // a repeated request gets the same range again
+    while (source < m_ble_context_p->otap.num_sources &&
+            m_ble_context_p->otap.sources[source].token != token) {
+        source++;
+    }
+    if (isOtapCompact(m_ble_context_p, &cmd_rx->payload.otap_begin_upload_req) !=
+            m_ble_context_p->otap.compact) {
+        // the data frames of this source would be parsed wrong
+        LOG(LVL_ERROR, "OTAP join with other frame format");
+        ret = APP_RET_INVALID_PARAM;
+    } else if (source == m_ble_context_p->otap.num_sources) {
+        ret = addOtapSource(m_ble_context_p, token);
+    }
+    LOG(LVL_INFO, "OTAP Join Upload Msg: %d, source: %d, ret: %d", cmd_rx->message_id, source, ret);
+
+    ble_adv_cmd_t cmd_rsp = {
+        .message_id =  getNextMessageId(m_ble_context_p),
+        .command = ble_ADV_CMD_OTAP_BEGIN_UPLOAD_RESPONSE,
+        .payload.otap_begin_upload_rsp.request_id = cmd_rx->message_id,
+        .payload.otap_begin_upload_rsp.start_message_id = m_ble_context_p->otap.start_message_id,
+        .payload.otap_begin_upload_rsp.response_code = ret,
+        .payload.otap_begin_upload_rsp.segment = m_ble_context_p->otap.segment,
+        .payload.otap_begin_upload_rsp.node_token = getNodeToken(),
+        .payload.otap_begin_upload_rsp.source = source,
+        .payload.otap_begin_upload_rsp.package_length = m_ble_context_p->otap.adv_package_length,
+        .payload.otap_begin_upload_rsp.repeat_count = m_ble_context_p->otap.repeat_count,
+    };
+    if (ret == APP_RET_OK) {
+        ble_otap_source_t* range = &m_ble_context_p->otap.sources[source];
+        uint16_t resume = getOtapFirstMissingIn(m_ble_context_p, range->first, range->end);
+
+        // the last package is sent in any case to trigger the completion check
+        if (resume >= range->end) {
+            resume = range->end - 1;
         }
+        cmd_rsp.payload.otap_begin_upload_rsp.resume_message_id = m_ble_context_p->otap.start_message_id + resume;
+        cmd_rsp.payload.otap_begin_upload_rsp.range_end_message_id = m_ble_context_p->otap.start_message_id +
+                range->end - 1;
+    }
+    bleSendCmd(m_ble_context_p, &cmd_rsp, BLE_ADV_CMD_OTAP_BEGIN_UPLOAD_RSP_LEN, 0);
+}
 
-        ret = Otap_bufferBegin();
+/** @brief counters of the dispatcher and the link, in one fragmented burst */
+static int handleStats(ble_adv_cmd_t* cmd_rx, uint8_t cmd_len) {
+    ble_stats_message_t msg = {
+        .message_id = getNextMessageId(m_ble_context_p),
+        .command = ble_ADV_CMD_STATS_RESPONSE,
+        .stats_rsp.request_id = cmd_rx->message_id,
+        .stats_rsp.cmd_rejected = m_ble_context_p->cmd_rejected,
+        .stats_rsp.link_rssi = m_ble_context_p->link_rssi,
+        .stats_rsp.link_received = m_ble_context_p->link_received,
+        .stats_rsp.link_lost = m_ble_context_p->link_lost,
+    };
 
-        if (ret != APP_RET_OK) {
-            LOG(LVL_ERROR, "Buffer_init failed: %d", ret);
-        }
+    LOG(LVL_INFO, "Stats Msg: %d", cmd_rx->message_id);
+    if (!(m_ble_context_p->capabilities & ble_CAP_FRAGMENT)) {
+        LOG(LVL_ERROR, "stats need fragments");
+        return APP_RET_NOT_SUPPORTED;
+    }
+    memcpy(msg.stats_rsp.cmd_count, m_ble_context_p->cmd_count, sizeof(msg.stats_rsp.cmd_count));
+    if (Ble_sendFragmented(m_ble_context_p, (const uint8_t*)&msg, sizeof(msg)) != APP_RET_OK) {
+        return APP_RET_OK;
+    }
+    if (cmd_rx->payload.stats_req.flags & BLE_STATS_RESET) {
+        memset(m_ble_context_p->cmd_count, 0, sizeof(m_ble_context_p->cmd_count));
+        m_ble_context_p->cmd_rejected = 0;
+    }
+    return APP_RET_OK;
+}
 
-        // give feedback to the app, that we are ready to receive the data
-        ble_adv_cmd_t cmd_rsp = {
-            .message_id =  getNextMessageId(m_ble_context_p),
-            .command = ble_ADV_CMD_OTAP_BEGIN_UPLOAD_RESPONSE,
-            .payload.otap_begin_upload_rsp.request_id = cmd_rx->message_id,
-            .payload.otap_begin_upload_rsp.start_message_id = m_ble_context_p->otap.start_message_id,
-            .payload.otap_begin_upload_rsp.response_code = ret,
+/** @brief start or resume an upload */
+static int handleOtapBeginUpload(ble_adv_cmd_t* cmd_rx, uint8_t cmd_len) {
+    uint8_t flags = cmd_rx->payload.otap_begin_upload_req.flags;
+
+    // a unicast upload is addressed with the token of the scan response, it
+    // must not wipe the buffer of every node in range. Multicast and
+    // multi-source uploads carry the transfer / source token instead
+    if (!(flags & (ble_OTAP_FLAG_MULTICAST | ble_OTAP_FLAG_MULTI_SOURCE)) &&
+            cmd_rx->payload.otap_begin_upload_req.token != getNodeToken()) {
+        LOG(LVL_DEBUG, "OTAP begin for token %d", cmd_rx->payload.otap_begin_upload_req.token);
+        return APP_RET_INVALID_PARAM;
+    }
+    if (isOtapJoin(m_ble_context_p, &cmd_rx->payload.otap_begin_upload_req)) {
+        handleOtapJoinUpload(cmd_rx, cmd_len);
+        return APP_RET_OK;
+    }
+
+    LOG(LVL_INFO, "OTAP Begin Upload Msg: %d", cmd_rx->message_id);
+    m_ble_context_p->otap.requested_package_length = cmd_rx->payload.otap_begin_upload_req.package_length &
+            ~BLE_OTAP_PACKAGE_COMPACT;
+    m_ble_context_p->otap.adv_package_length = m_ble_context_p->otap.requested_package_length;
+
+    // needed for a stored upload, the result is checked with the settings below
+    int ret = Otap_init();
+
+    uint8_t link_package_length;
+    recommendOtapLink(m_ble_context_p, m_ble_context_p->otap.requested_package_length,
+                      getLinkLoss(m_ble_context_p), &link_package_length,
+                      &m_ble_context_p->otap.repeat_count);
+    if (m_ble_context_p->capabilities & ble_CAP_LINK_ADAPT) {
+        otap_manifest_t stored;
+
+        // an interrupted upload continues with its length
+        if (ret == APP_RET_OK && Otap_bufferStored(&stored) == APP_RET_OK &&
+                stored.sequence == cmd_rx->payload.otap_begin_upload_req.scratchpad_sequence_number &&
+                stored.image_length == cmd_rx->payload.otap_begin_upload_req.scratchpad_length &&
+                stored.package_length <= m_ble_context_p->otap.requested_package_length) {
+            link_package_length = stored.package_length;
+        }
+        m_ble_context_p->otap.adv_package_length = link_package_length;
+    }
+    m_ble_context_p->otap.compact = isOtapCompact(m_ble_context_p, &cmd_rx->payload.otap_begin_upload_req);
+    m_ble_context_p->otap.scratchpad_length = cmd_rx->payload.otap_begin_upload_req.scratchpad_length;
+    m_ble_context_p->otap.scratchpad_seqeunce_number = cmd_rx->payload.otap_begin_upload_req.scratchpad_sequence_number;
+    m_ble_context_p->otap.flags = cmd_rx->payload.otap_begin_upload_req.flags;
+    m_ble_context_p->otap.stream_length = m_ble_context_p->otap.scratchpad_length;
+    if (m_ble_context_p->otap.flags & (ble_OTAP_FLAG_COMPRESSED | ble_OTAP_FLAG_DELTA)) {
+        m_ble_context_p->otap.stream_length = cmd_rx->payload.otap_begin_upload_req.stream_length;
+    }
+    m_ble_context_p->otap.image_crc = cmd_rx->payload.otap_begin_upload_req.image_crc;
+    m_ble_context_p->otap.transfer_id = cmd_rx->payload.otap_begin_upload_req.token;
+    m_ble_context_p->otap.total_messages = 0;
+    if (m_ble_context_p->otap.adv_package_length > 0) {
+        m_ble_context_p->otap.total_messages = (m_ble_context_p->otap.stream_length +
+                                                m_ble_context_p->otap.adv_package_length - 1) /
+                                               m_ble_context_p->otap.adv_package_length;
+    }
+    m_ble_context_p->otap.num_segments = (m_ble_context_p->otap.total_messages + BLE_OTAP_SEGMENT_PACKAGES - 1) /
+                                         BLE_OTAP_SEGMENT_PACKAGES;
+    m_ble_context_p->otap.begin_s = lib_time->getTimestampS();
+    m_ble_context_p->otap.received_packages = 0;
+
+    if (ret != APP_RET_OK) {
+        LOG(LVL_ERROR, "Otap_init failed: %d", ret);
+    } else if (m_ble_context_p->otap.total_messages == 0) {
+        ret = APP_RET_INVALID_PARAM;
+    } else if (m_ble_context_p->otap.requested_package_length >
+               getMaxPackageLength(m_ble_context_p, m_ble_context_p->otap.compact)) {
+        // the last bytes of every package would be lost
+        LOG(LVL_ERROR, "package length too large: %d", m_ble_context_p->otap.requested_package_length);
+        ret = APP_RET_INVALID_PARAM;
+    } else if ((m_ble_context_p->otap.flags & ble_OTAP_FLAG_COMPRESSED) &&
+            (m_ble_context_p->otap.flags & ble_OTAP_FLAG_DELTA)) {
+        // a stream is either compressed or a patch
+        LOG(LVL_ERROR, "invalid otap flags: 0x%02x", m_ble_context_p->otap.flags);
+        ret = APP_RET_INVALID_FLAGS;
+    } else {
+        otap_manifest_t manifest = {
+            .image_length = m_ble_context_p->otap.scratchpad_length,
+            .sequence = m_ble_context_p->otap.scratchpad_seqeunce_number,
+            .encoding = getOtapEncoding(m_ble_context_p->otap.flags),
+            .stream_length = m_ble_context_p->otap.stream_length,
+            .package_length = m_ble_context_p->otap.adv_package_length,
+            .check_image_crc = (m_ble_context_p->otap.flags & ble_OTAP_FLAG_IMAGE_CRC) != 0,
+            .image_crc = m_ble_context_p->otap.image_crc,
         };
-        bleSendCmd(m_ble_context_p, &cmd_rsp, BLE_ADV_CMD_OTAP_BEGIN_UPLOAD_RSP_LEN, 0);
-    } else if (cmd_rx->command == (ble_ADV_CMD_OTAP_UPLOAD_REQUEST) &&
-               m_ble_context_p->otap.start_message_id <= cmd_rx->message_id &&
-               m_ble_context_p->otap.end_message_id >= cmd_rx->message_id) {
-        int message_id = cmd_rx->message_id - m_ble_context_p->otap.start_message_id;
-        // write the data to the buffer
-        int ret = Otap_bufferWrite(&cmd_rx->payload.otap_upload_req.data_start, m_ble_context_p->otap.adv_package_length,
-                                   (cmd_rx->message_id - m_ble_context_p->otap.start_message_id) * m_ble_context_p->otap.adv_package_length);
 
-        if (ret != APP_RET_OK) {
-            LOG(LVL_ERROR, "otap_upload failed: %d", ret);
+        // the stack is stopped first, also for the erase of the buffer.
+        // Without it, the upload is only slower
+        if (!(m_ble_context_p->otap.flags & ble_OTAP_FLAG_TURBO)) {
+            stopOtapTurbo(m_ble_context_p);
+        } else if (startOtapTurbo(m_ble_context_p) != APP_RET_OK) {
+            LOG(LVL_ERROR, "otap turbo not possible, stack keeps running");
+        }
+
+        m_ble_context_p->otap.direct = (m_ble_context_p->otap.flags & ble_OTAP_FLAG_DIRECT) != 0;
+        if (m_ble_context_p->otap.direct) {
+            // nothing is in a buffer, the upload starts from the beginning
+            ret = Otap_directBegin(&manifest);
+            if (ret == APP_RET_INVALID_STATE) {
+                // the stack keeps running, the buffer takes the upload
+                LOG(LVL_ERROR, "direct upload not possible, buffered");
+                m_ble_context_p->otap.direct = false;
+                ret = APP_RET_OK;
+            }
+        }
+
+        if (ret != APP_RET_OK || m_ble_context_p->otap.direct) {
+            // upload is rejected below, or nothing to buffer
+        } else if ((m_ble_context_p->otap.flags & ble_OTAP_FLAG_KEEP_PAGES) ||
+                       Otap_bufferResume(&manifest) != APP_RET_OK) {
+            // fails fast, if the upload does not fit into the buffer
+            ret = Otap_bufferBegin(&manifest,
+                                   (m_ble_context_p->otap.flags & ble_OTAP_FLAG_KEEP_PAGES) != 0);
         } else {
-            // set the message received flag
-            m_ble_context_p->otap.messageReceived[message_id/8] |= 1 << (message_id % 8);
+            LOG(LVL_INFO, "OTAP upload resumed");
         }
-        bool lastMessageReceived = m_ble_context_p->otap.messageReceived[(m_ble_context_p->otap.total_messages-1) / 8] & (1 << ((m_ble_context_p->otap.total_messages-1) % 8));
-        // be kind, and send some status messages back:
-        if (cmd_rx->message_id % 10 == 0 || lastMessageReceived) {
-            int percentage = (int)(message_id * 90 / m_ble_context_p->otap.total_messages);
-            if (lastMessageReceived) {
-                int missing_messages = 0;
-                for (int i = 0; i < m_ble_context_p->otap.total_messages; i++) {
-                    if (!(m_ble_context_p->otap.messageReceived[i / 8] &
-                            (1 << (i % 8)))) {
-                        missing_messages++;
-                    }
-                }
-                percentage = 90 + (int)(10 / (missing_messages + 1));
+    }
+
+    uint16_t resume_message_id = 0;
+    if (ret != APP_RET_OK) {
+        LOG(LVL_ERROR, "Buffer_init failed: %d", ret);
+        stopOtapTurbo(m_ble_context_p);
+        // do not accept any upload package
+        m_ble_context_p->otap.segment = 0;
+        m_ble_context_p->otap.start_message_id = BLE_OTAP_FIRST_MESSAGE_ID;
+        m_ble_context_p->otap.end_message_id = 0;
+        m_ble_context_p->otap.num_sources = 0;
+    } else {
+        // further smartphones join with ble_OTAP_FLAG_MULTI_SOURCE
+        m_ble_context_p->otap.sources[0].token = cmd_rx->payload.otap_begin_upload_req.token;
+        m_ble_context_p->otap.num_sources = 1;
+        // the first segment with missing packages, the last package is
+        // sent in any case to trigger the completion check
+        for (uint16_t segment = 0; segment < m_ble_context_p->otap.num_segments; segment++) {
+            startOtapSegment(m_ble_context_p, segment);
+            if (getOtapFirstMissing(m_ble_context_p) < m_ble_context_p->otap.segment_messages) {
+                break;
             }
-            LOG(LVL_INFO, "OTAP Upload Status Msg: %d/%d", message_id,
-                m_ble_context_p->otap.total_messages);
-            ble_adv_cmd_t cmd_rsp = {
-                .message_id = getNextMessageId(m_ble_context_p),
-                .command = ble_ADV_CMD_OTAP_UPLOAD_RESPONSE,
-                .payload.otap_upload_rsp.request_id = cmd_rx->message_id,
-                .payload.otap_upload_rsp.response_code = ble_STATUS_OTAP_UPLOAD,
-                .payload.otap_upload_rsp.percentage = percentage,
-            };
-            // wait, till we have answer to this message:
-            bleSendCmd(m_ble_context_p, &cmd_rsp,
-                       BLE_ADV_CMD_OTAP_UPLOAD_RSP_LEN, 0);
         }
+        resume_message_id = m_ble_context_p->otap.start_message_id + getOtapFirstMissing(m_ble_context_p);
+        if (resume_message_id > m_ble_context_p->otap.end_message_id) {
+            resume_message_id = m_ble_context_p->otap.end_message_id;
+        }
+    }
+
+    // give feedback to the app, that we are ready to receive the data
+    ble_adv_cmd_t cmd_rsp = {
+        .message_id =  getNextMessageId(m_ble_context_p),
+        .command = ble_ADV_CMD_OTAP_BEGIN_UPLOAD_RESPONSE,
+        .payload.otap_begin_upload_rsp.request_id = cmd_rx->message_id,
+        .payload.otap_begin_upload_rsp.start_message_id = m_ble_context_p->otap.start_message_id,
+        .payload.otap_begin_upload_rsp.response_code = ret,
+        .payload.otap_begin_upload_rsp.resume_message_id = resume_message_id,
+        .payload.otap_begin_upload_rsp.segment = m_ble_context_p->otap.segment,
+        .payload.otap_begin_upload_rsp.node_token = getNodeToken(),
+        .payload.otap_begin_upload_rsp.range_end_message_id = m_ble_context_p->otap.end_message_id,
+        .payload.otap_begin_upload_rsp.package_length = link_package_length,
+        .payload.otap_begin_upload_rsp.repeat_count = m_ble_context_p->otap.repeat_count,
+    };
+    bleSendCmd(m_ble_context_p, &cmd_rsp, BLE_ADV_CMD_OTAP_BEGIN_UPLOAD_RSP_LEN, 0);
+    return APP_RET_OK;
+}
+
+/** @brief hashes of the pages in the buffer, for ble_OTAP_FLAG_KEEP_PAGES */
+static int handleOtapPageHash(ble_adv_cmd_t* cmd_rx, uint8_t cmd_len) {
+    int ret = Otap_init();
+
+    LOG(LVL_INFO, "OTAP Page Hash Msg: %d", cmd_rx->message_id);
+    if (ret != APP_RET_OK) {
+        LOG(LVL_ERROR, "Otap_init failed: %d", ret);
+        return APP_RET_OK;
+    }
+
+    // hashing all pages takes too long for the receive callback, a repeated
+    // request starts over
+    m_ble_context_p->otap.hash_request_id = cmd_rx->message_id;
+    m_ble_context_p->otap.hash_next_page = 0;
+    if (App_Scheduler_addTask_execTime_Caller(bleOtapPageHashTask, m_ble_context_p,
+            APP_SCHEDULER_SCHEDULE_ASAP,
+            BLE_OTAP_PAGE_HASH_EXEC_TIME_US) != APP_SCHEDULER_RES_OK) {
+        LOG(LVL_ERROR, "Cannot start page hash task");
+    }
+    return APP_RET_OK;
+}
+
+/** @brief pages to keep for the next begin upload request */
+static int handleOtapKeepPages(ble_adv_cmd_t* cmd_rx, uint8_t cmd_len) {
+    LOG(LVL_INFO, "OTAP Keep Pages Msg: %d, pages: 0x%08x from %d", cmd_rx->message_id,
+        cmd_rx->payload.otap_keep_pages_req.keep_pages,
+        cmd_rx->payload.otap_keep_pages_req.first_page);
+    // used by the next begin upload request
+    Otap_keepPages(cmd_rx->payload.otap_keep_pages_req.first_page,
+                   cmd_rx->payload.otap_keep_pages_req.keep_pages);
+
+    ble_adv_cmd_t cmd_rsp = {
+        .message_id = getNextMessageId(m_ble_context_p),
+        .command = ble_ADV_CMD_OTAP_KEEP_PAGES_RESPONSE,
+        .payload.otap_keep_pages_rsp.request_id = cmd_rx->message_id,
+        .payload.otap_keep_pages_rsp.response_code = APP_RET_OK,
+    };
+    bleSendCmd(m_ble_context_p, &cmd_rsp, BLE_ADV_CMD_OTAP_KEEP_PAGES_RSP_LEN, 0);
+    return APP_RET_OK;
+}
+
+/** @brief the upload is complete, answer the last package and reboot into
+ * the new firmware
+ *
+ * Called from the Otap_bufferEnd() task, or right away for a direct upload
+ */
+static void otapUploadEnded(int ret) {
+    bool direct = m_ble_context_p->otap.direct;
+
+    if (ret != APP_RET_OK) {
+        LOG(LVL_ERROR, "otap_upload failed: %d", ret);
+    }
+
+    ble_adv_cmd_t cmd_rsp = {
+        .message_id = getNextMessageId(m_ble_context_p),
+        .command = ble_ADV_CMD_OTAP_UPLOAD_RESPONSE,
+        .payload.otap_upload_rsp.request_id = m_ble_context_p->otap.end_request_id,
+        .payload.otap_upload_rsp.response_code = (ret == APP_RET_OK) ? ble_STATUS_OTAP_OK :
+                ble_STATUS_OTAP_ERR_FAILED,
+        .payload.otap_upload_rsp.error = ret,
+        .payload.otap_upload_rsp.percentage = 100,
+        .payload.otap_upload_rsp.segment = m_ble_context_p->otap.segment,
+        .payload.otap_upload_rsp.node_token = getNodeToken(),
+    };
+    m_ble_context_p->keep_sending = 0;
+    bleSendCmd(m_ble_context_p, &cmd_rsp,
+               BLE_ADV_CMD_OTAP_UPLOAD_RSP_LEN, 0);
+
+    if (direct) {
+        // the scratchpad is processed by the stack on the reboot,
+        // which also starts the stopped stack after a failure
+    } else if (ret != APP_RET_OK) {
+        // the image in the buffer is not usable, keep the running firmware
+        stopOtapTurbo(m_ble_context_p);
+        return;
+    } else {
+        // set flag: in next reboot, process OTAP Image
+        m_ble_context_p->app_settings_p->do_otap = 1;
+        AppSettings_store(m_ble_context_p->app_settings_p);
+    }
+
+    // send a reboot command
+    Sm_fireEvent(m_ble_context_p->fsm_sm_context_p, fsm_E_REBOOT, 500);
+}
 
+/** @brief one package of the current segment */
+static int handleOtapUpload(ble_adv_cmd_t* cmd_rx, uint8_t cmd_len) {
+    int message_id = cmd_rx->message_id - m_ble_context_p->otap.start_message_id;
+    // package number in the whole upload
+    uint32_t package = (uint32_t)m_ble_context_p->otap.segment * BLE_OTAP_SEGMENT_PACKAGES + message_id;
+    bool direct = m_ble_context_p->otap.direct;
+    bool multicast = (m_ble_context_p->otap.flags & ble_OTAP_FLAG_MULTICAST) != 0;
+    bool multi_source = (m_ble_context_p->otap.flags & ble_OTAP_FLAG_MULTI_SOURCE) != 0;
+    uint8_t source = getOtapSource(m_ble_context_p, message_id);
+    ble_otap_source_t* range = &m_ble_context_p->otap.sources[source];
+    uint32_t expected = m_ble_context_p->otap.adv_package_length;
+
+    // a truncated frame would be padded with zeros, the last package of the
+    // upload may be shorter
+    if ((package + 1) * expected > m_ble_context_p->otap.stream_length &&
+            package * expected < m_ble_context_p->otap.stream_length) {
+        expected = m_ble_context_p->otap.stream_length - package * expected;
+    }
+    if (cmd_len < BLE_ADV_HEADER_LEN + expected) {
+        LOG(LVL_DEBUG, "upload package %u too short: %d", package, cmd_len);
+        return APP_RET_INVALID_LENGTH;
+    }
 
-        // check if we have received the last message
-        if (lastMessageReceived) {
-            LOG(LVL_INFO, "otap_upload finished");
-            // do we have all messages?
-            for (int i = 0; i < m_ble_context_p->otap.total_messages; i++) {
-                if (!(m_ble_context_p->otap.messageReceived[i/8] & (1 << (i % 8)))) {
-                    LOG(LVL_ERROR, "OTAP_UPLOAD_REQUEST Msg: missing message: %d", i);
-                    // we have a missing message, send a request for it
-                    ble_adv_cmd_t cmd_req = {
-                        .message_id =  getNextMessageId(m_ble_context_p),
-                        .command = ble_ADV_CMD_RESEND_MESSAGE_REQUEST,
-                        .payload.resend_message_req.resend_message_id = m_ble_context_p->otap.start_message_id + i
-                    };
-                    m_ble_context_p->keep_sending = cmd_req.message_id;
-                    bleSendCmd(m_ble_context_p, &cmd_req, BLE_ADV_CMD_RESEND_MESSAGE_REQ_LEN, 1);
-                    return;
+    // write the data to the buffer or the scratchpad
+    int ret = direct ?
+              Otap_directWrite(&cmd_rx->payload.otap_upload_req.data_start, m_ble_context_p->otap.adv_package_length,
+                               package) :
+              Otap_bufferWrite(&cmd_rx->payload.otap_upload_req.data_start, m_ble_context_p->otap.adv_package_length,
+                               package * m_ble_context_p->otap.adv_package_length);
+
+    if (ret != APP_RET_OK && direct && ret != APP_RET_BUSY) {
+        // the scratchpad cannot be completed, reboot to start the stack again
+        LOG(LVL_ERROR, "otap_upload failed: %d", ret);
+        ble_adv_cmd_t cmd_rsp = {
+            .message_id = getNextMessageId(m_ble_context_p),
+            .command = ble_ADV_CMD_OTAP_UPLOAD_RESPONSE,
+            .payload.otap_upload_rsp.request_id = cmd_rx->message_id,
+            .payload.otap_upload_rsp.response_code = ble_STATUS_OTAP_ERR_FAILED,
+            .payload.otap_upload_rsp.error = ret,
+            .payload.otap_upload_rsp.segment = m_ble_context_p->otap.segment,
+            .payload.otap_upload_rsp.node_token = getNodeToken(),
+        };
+        m_ble_context_p->keep_sending = 0;
+        m_ble_context_p->otap.end_message_id = 0;
+        bleSendCmd(m_ble_context_p, &cmd_rsp, BLE_ADV_CMD_OTAP_UPLOAD_RSP_LEN, 0);
+        Sm_fireEvent(m_ble_context_p->fsm_sm_context_p, fsm_E_REBOOT, 500);
+        return APP_RET_OK;
+    } else if (ret != APP_RET_OK) {
+        LOG(LVL_ERROR, "otap_upload failed: %d", ret);
+    } else if (!(m_ble_context_p->otap.messageReceived[message_id / 8] & (1 << (message_id % 8)))) {
+        // set the message received flag
+        m_ble_context_p->otap.messageReceived[message_id/8] |= 1 << (message_id % 8);
+        m_ble_context_p->otap.received_packages++;
+        m_ble_context_p->otap.last_package_s = lib_time->getTimestampS();
+        // journal complete groups, so the upload survives a disconnect or reboot
+        if (!direct && isOtapGroupReceived(m_ble_context_p, message_id / OTAP_JOURNAL_GROUP_LEN)) {
+            Otap_bufferProgress(package / OTAP_JOURNAL_GROUP_LEN);
+        }
+    }
+    int last = m_ble_context_p->otap.segment_messages - 1;
+    bool lastMessageReceived = m_ble_context_p->otap.messageReceived[last / 8] & (1 << (last % 8));
+    // every source of a multi-source upload ends its range with the last package of it
+    bool checkComplete = multi_source ? message_id == range->end - 1 : lastMessageReceived;
+    // be kind, and send some status messages back, not from all nodes of
+    // a multicast upload
+    if (!multicast && (cmd_rx->message_id % 10 == 0 || lastMessageReceived)) {
+        int percentage = (int)((uint64_t)package * 90 / m_ble_context_p->otap.total_messages);
+        if (lastMessageReceived &&
+                m_ble_context_p->otap.segment + 1 == m_ble_context_p->otap.num_segments) {
+            int missing_messages = 0;
+            for (int i = 0; i < m_ble_context_p->otap.segment_messages; i++) {
+                if (!(m_ble_context_p->otap.messageReceived[i / 8] &
+                        (1 << (i % 8)))) {
+                    missing_messages++;
                 }
             }
+            percentage = 90 + (int)(10 / (missing_messages + 1));
+        }
+        LOG(LVL_INFO, "OTAP Upload Status Msg: %d/%d", package,
+            m_ble_context_p->otap.total_messages);
+        ble_adv_cmd_t cmd_rsp = {
+            .message_id = getNextMessageId(m_ble_context_p),
+            .command = ble_ADV_CMD_OTAP_UPLOAD_RESPONSE,
+            .payload.otap_upload_rsp.request_id = cmd_rx->message_id,
+            .payload.otap_upload_rsp.response_code = ble_STATUS_OTAP_UPLOAD,
+            .payload.otap_upload_rsp.percentage = percentage,
+            .payload.otap_upload_rsp.segment = m_ble_context_p->otap.segment,
+            .payload.otap_upload_rsp.node_token = getNodeToken(),
+            .payload.otap_upload_rsp.range_end_message_id = m_ble_context_p->otap.start_message_id + range->end - 1,
+            .payload.otap_upload_rsp.num_sources = m_ble_context_p->otap.num_sources,
+        };
+        // wait, till we have answer to this message:
+        bleSendCmd(m_ble_context_p, &cmd_rsp,
+                   BLE_ADV_CMD_OTAP_UPLOAD_RSP_LEN, 0);
+    }
+
 
-            // upload is done
-            ret = Otap_bufferEnd(
-                      m_ble_context_p->otap.scratchpad_length,
-                      m_ble_context_p->otap.scratchpad_seqeunce_number);
+    // the loss of the segment decides the repeat count of the next one
+    if (checkComplete && !m_ble_context_p->otap.segment_checked) {
+        uint16_t missing_messages = 0;
+        for (uint16_t i = 0; i < m_ble_context_p->otap.segment_messages; i++) {
+            if (!(m_ble_context_p->otap.messageReceived[i / 8] & (1 << (i % 8)))) {
+                missing_messages++;
+            }
+        }
+        m_ble_context_p->otap.segment_checked = true;
+        m_ble_context_p->otap.segment_loss = (uint32_t)missing_messages * 1000 /
+                                             m_ble_context_p->otap.segment_messages;
+    }
+
+    // check if we have received the last message
+    if (checkComplete) {
+        LOG(LVL_INFO, "otap_upload segment %d finished", m_ble_context_p->otap.segment);
+        // do we have all messages?
+        uint16_t missing = getOtapFirstMissing(m_ble_context_p);
+        if (missing < m_ble_context_p->otap.segment_messages) {
+            LOG(LVL_ERROR, "OTAP_UPLOAD_REQUEST Msg: missing message: %d", missing);
+            if (multi_source) {
+                // every source resends its own range, the others may
+                // still be busy
+                missing = getOtapFirstMissingIn(m_ble_context_p, range->first, range->end);
+                if (missing < range->end) {
+                    sendOtapNack(m_ble_context_p, missing);
+                }
+                return APP_RET_OK;
+            }
+            if (multicast || (m_ble_context_p->capabilities & ble_CAP_NACK)) {
+                // the smartphone does not wait for a single node, or
+                // takes the gaps at once
+                sendOtapNack(m_ble_context_p, missing);
+                return APP_RET_OK;
+            }
+            // we have a missing message, send a request for it
+            ble_adv_cmd_t cmd_req = {
+                .message_id =  getNextMessageId(m_ble_context_p),
+                .command = ble_ADV_CMD_RESEND_MESSAGE_REQUEST,
+                .payload.resend_message_req.resend_message_id = m_ble_context_p->otap.start_message_id + missing
+            };
+            m_ble_context_p->keep_sending = cmd_req.message_id;
+            bleSendCmd(m_ble_context_p, &cmd_req, BLE_ADV_CMD_RESEND_MESSAGE_REQ_LEN, 1);
+            return APP_RET_OK;
+        }
 
-            if (ret != APP_RET_OK) {
-                LOG(LVL_ERROR, "otap_upload failed: %d", ret);
+        // segment is done, the smartphone continues with the next one
+        if (m_ble_context_p->otap.segment + 1 < m_ble_context_p->otap.num_segments) {
+            // the package length is fixed for the upload, only the repeat
+            // count follows the link
+            m_ble_context_p->otap.repeat_count = recommendOtapRepeat(m_ble_context_p,
+                                                 m_ble_context_p->otap.segment_loss);
+            startOtapSegment(m_ble_context_p, m_ble_context_p->otap.segment + 1);
+            missing = getOtapFirstMissing(m_ble_context_p);
+            if (missing >= m_ble_context_p->otap.segment_messages) {
+                // the last package is sent in any case to trigger the
+                // completion check
+                missing = m_ble_context_p->otap.segment_messages - 1;
             }
 
             ble_adv_cmd_t cmd_rsp = {
                 .message_id = getNextMessageId(m_ble_context_p),
                 .command = ble_ADV_CMD_OTAP_UPLOAD_RESPONSE,
                 .payload.otap_upload_rsp.request_id = cmd_rx->message_id,
-                .payload.otap_upload_rsp.response_code = ble_STATUS_OTAP_OK,
-                .payload.otap_upload_rsp.percentage = 100
+                .payload.otap_upload_rsp.response_code = ble_STATUS_OTAP_SEGMENT_DONE,
+                .payload.otap_upload_rsp.percentage = (int)((uint64_t)package * 90 / m_ble_context_p->otap.total_messages),
+                .payload.otap_upload_rsp.segment = m_ble_context_p->otap.segment,
+                .payload.otap_upload_rsp.node_token = getNodeToken(),
+                .payload.otap_upload_rsp.next_message_id = m_ble_context_p->otap.start_message_id + missing,
+                .payload.otap_upload_rsp.num_sources = m_ble_context_p->otap.num_sources,
+                .payload.otap_upload_rsp.repeat_count = m_ble_context_p->otap.repeat_count,
             };
             m_ble_context_p->keep_sending = 0;
             bleSendCmd(m_ble_context_p, &cmd_rsp,
                        BLE_ADV_CMD_OTAP_UPLOAD_RSP_LEN, 0);
-            // set flag: in next reboot, process OTAP Image
-            m_ble_context_p->app_settings_p->do_otap = 1;
-            AppSettings_store(m_ble_context_p->app_settings_p);
+            return APP_RET_OK;
+        }
 
-            // send a reboot command
-            Sm_fireEvent(m_ble_context_p->fsm_sm_context_p, fsm_E_REBOOT, 500);
+        // upload is done
+        logOtapThroughput(m_ble_context_p);
+        m_ble_context_p->otap.end_request_id = cmd_rx->message_id;
+        if (direct) {
+            otapUploadEnded(Otap_directEnd());
+            return APP_RET_OK;
+        }
+        // the image check runs in the background, packages repeated
+        // meanwhile are not written again
+        m_ble_context_p->otap.end_message_id = 0;
+        ret = Otap_bufferEnd(otapUploadEnded);
+        if (ret != APP_RET_OK) {
+            otapUploadEnded(ret);
         }
     }
+    return APP_RET_OK;
+}
+
+/** commands from the smartphone, indexed by command code, see bleHandleCmd() */
+static const ble_cmd_entry_t m_cmd_table[BLE_ADV_CMD_REQUEST_CODES] = {
+    [ble_ADV_CMD_SCAN_REQUEST] = {
+        // older apps send no capabilities
+        .min_len = BLE_ADV_HEADER_LEN + offsetof(ble_adv_cmd_scan_req_t, capabilities),
+        .session = ble_SESSION_NONE,
+        .handler = handleScanRequest,
+    },
+    [ble_ADV_CMD_PROBE_REQUEST] = {
+        .min_len = BLE_ADV_CMD_PROBE_MIN_LEN,
+        .session = ble_SESSION_NONE,
+        .handler = handleProbe,
+    },
+    [ble_ADV_CMD_STATS_REQUEST] = {
+        .min_len = BLE_ADV_CMD_STATS_REQ_LEN,
+        .session = ble_SESSION_NONE,
+        .handler = handleStats,
+    },
+    [ble_ADV_CMD_OTAP_BEGIN_UPLOAD_REQUEST] = {
+        // older apps send no flags
+        .min_len = BLE_ADV_HEADER_LEN + offsetof(ble_adv_cmd_otap_begin_upload_req_t, flags),
+        .session = ble_SESSION_NONE,
+        .handler = handleOtapBeginUpload,
+    },
+    [ble_ADV_CMD_OTAP_PAGE_HASH_REQUEST] = {
+        .min_len = BLE_ADV_CMD_OTAP_PAGE_HASH_REQ_LEN,
+        .session = ble_SESSION_NONE,
+        .handler = handleOtapPageHash,
+    },
+    [ble_ADV_CMD_OTAP_KEEP_PAGES_REQUEST] = {
+        // older apps send no first page
+        .min_len = BLE_ADV_HEADER_LEN + offsetof(ble_adv_cmd_otap_keep_pages_req_t, first_page),
+        .session = ble_SESSION_NONE,
+        .handler = handleOtapKeepPages,
+    },
+    [ble_ADV_CMD_OTAP_UPLOAD_REQUEST] = {
+        .min_len = BLE_ADV_HEADER_LEN + 1,
+        .session = ble_SESSION_UPLOAD,
+        .handler = handleOtapUpload,
+    },
+};
+
+/** @brief handle one command from the smartphone
+ *
+ * The table entry of the command tells, if it is complete and allowed now,
+ * before its handler runs. Handled and rejected commands are counted.
+ *
+ * @param cmd_rx a single frame or a reassembled message
+ * @param cmd_len length of the command, header included
+ */
+static void bleHandleCmd(ble_adv_cmd_t* cmd_rx, uint8_t cmd_len) {
+    const ble_cmd_entry_t* entry;
+
+    // responses and unknown codes have no handler
+    if (cmd_rx->command >= NUM(m_cmd_table) || m_cmd_table[cmd_rx->command].handler == NULL) {
+        LOG(LVL_DEBUG, "unknown command: 0x%02x", cmd_rx->command);
+        m_ble_context_p->cmd_rejected++;
+        return;
+    }
+    entry = &m_cmd_table[cmd_rx->command];
+
+    if (cmd_len < entry->min_len) {
+        LOG(LVL_DEBUG, "command 0x%02x to small: %d", cmd_rx->command, cmd_len);
+        m_ble_context_p->cmd_rejected++;
+        return;
+    }
+    // packages of an older segment or of no upload at all
+    if (entry->session == ble_SESSION_UPLOAD &&
+            (cmd_rx->message_id < m_ble_context_p->otap.start_message_id ||
+             cmd_rx->message_id > m_ble_context_p->otap.end_message_id)) {
+        m_ble_context_p->cmd_rejected++;
+        return;
+    }
+    // control messages never use upload ids, see BLE_CONTROL_MESSAGE_ID_MAX
+    if (entry->session == ble_SESSION_NONE && (cmd_rx->message_id & BLE_OTAP_FIRST_MESSAGE_ID)) {
+        LOG(LVL_DEBUG, "command 0x%02x with upload id: %d", cmd_rx->command, cmd_rx->message_id);
+        m_ble_context_p->cmd_rejected++;
+        return;
+    }
+
+    if (entry->handler(cmd_rx, cmd_len) == APP_RET_OK) {
+        m_ble_context_p->cmd_count[cmd_rx->command]++;
+    } else {
+        m_ble_context_p->cmd_rejected++;
+    }
 }
 /* }}} callbacks / handler */
 
@@ -652,7 +1800,63 @@ static uint32_t bleSendTask(void* me) {
         return 2000;
     }
 
-    return 250; // 100ms
+    return BLE_TX_DWELL_MS;
+}
+
+static uint32_t bleOtapTurboTask(void* me) {
+    __ASSERT(me != NULL, "caller not set");
+    Ble_context* ble = (Ble_context*)me;
+
+    // upload ended, the reboot starts the stack
+    if (!ble->otap.turbo) {
+        return APP_SCHEDULER_STOP_TASK;
+    }
+
+    if (lib_time->getTimestampS() - ble->otap.last_package_s < BLE_OTAP_TURBO_TIMEOUT_S) {
+        return 1000;
+    }
+
+    // smartphone is gone, a direct upload cannot be continued with the stack
+    // running, a buffered one is resumed with a new begin request
+    LOG(LVL_INFO, "otap turbo timeout");
+    logOtapThroughput(ble);
+    ble->otap.end_message_id = 0;
+    stopOtapTurbo(ble);
+    return APP_SCHEDULER_STOP_TASK;
+}
+
+static uint32_t bleOtapPageHashTask(void* me) {
+    __ASSERT(me != NULL, "caller not set");
+    Ble_context* ble = (Ble_context*)me;
+    uint16_t first = ble->otap.hash_next_page;
+    uint16_t page_size;
+    uint16_t header_size;
+    uint8_t num_pages;
+
+    Otap_pageInfo(&page_size, &header_size, &num_pages);
+    if (first >= num_pages) {
+        return APP_SCHEDULER_STOP_TASK;
+    }
+
+    ble_adv_cmd_t cmd_rsp = {
+        .message_id = getNextMessageId(ble),
+        .command = ble_ADV_CMD_OTAP_PAGE_HASH_RESPONSE,
+        .payload.otap_page_hash_rsp.request_id = ble->otap.hash_request_id,
+        .payload.otap_page_hash_rsp.page_size = page_size,
+        .payload.otap_page_hash_rsp.header_size = header_size,
+        .payload.otap_page_hash_rsp.num_pages = num_pages,
+        .payload.otap_page_hash_rsp.first_page = first,
+    };
+    for (uint8_t i = 0; i < BLE_OTAP_PAGE_HASHES_PER_RSP && first + i < num_pages; i++) {
+        uint32_t hash = 0;
+        Otap_pageHash(first + i, &hash);
+        cmd_rsp.payload.otap_page_hash_rsp.hash[i] = hash;
+    }
+    bleSendCmd(ble, &cmd_rsp, BLE_ADV_CMD_OTAP_PAGE_HASH_RSP_LEN, 0);
+
+    ble->otap.hash_next_page = first + BLE_OTAP_PAGE_HASHES_PER_RSP;
+    return ble->otap.hash_next_page < num_pages ? APP_SCHEDULER_SCHEDULE_ASAP :
+           APP_SCHEDULER_STOP_TASK;
 }
 
 /* }}} tasks */
@@ -684,6 +1888,30 @@ extern void Ble_createStatic(Ble_context* const ble_context_p,
                     DEBUG_LOG_MODULE_NAME, m_event_matrix, NUM(m_event_matrix),
                     m_event_queue, EVENT_QUEUE_LEN);
 }
+extern uint32_t Ble_sendFragmented(Ble_context* const me, const uint8_t* data, uint16_t len) {
+    uint32_t ret = APP_RET_OK;
+    uint8_t index = 0;
+
+    if (len == 0 || len > BLE_FRAGMENT_MAX_LEN) {
+        return APP_RET_INVALID_LENGTH;
+    }
+    while (len > 0 && ret == APP_RET_OK) {
+        uint8_t amount = len > BLE_FRAGMENT_DATA_LEN ? BLE_FRAGMENT_DATA_LEN : len;
+        ble_adv_cmd_t cmd = {
+            .message_id = getNextMessageId(me),
+            .command = ble_ADV_CMD_FRAGMENT_RESPONSE,
+            .payload.fragment.fragment = index | (amount == len ? BLE_FRAGMENT_LAST : 0),
+        };
+
+        memcpy(cmd.payload.fragment.data, data, amount);
+        ret = bleSendCmd(me, &cmd, BLE_ADV_HEADER_LEN + 1 + amount, 0);
+        data += amount;
+        len -= amount;
+        index++;
+    }
+    return ret;
+}
+
 extern void Ble_destroyStatic(Ble_context* const me) {
     // not much to do here in static variant
     Sm_destroyStatic(me->sm_context_p);
@@ -34,13 +34,51 @@
 /** maximal backlog for sending BLE advertising packages */
 #define BLE_TX_LIST_LEN 1024
 
-/* 4096 packages * 12 bytes = 49152 bytes max */
-#define BLE_OTAP_MAX_NUMBER_OF_PACKAGES 4096
+/** upload packages are received in segments of this many packages, the
+ * receive state is kept for the current segment only
+ * (multiple of OTAP_JOURNAL_GROUP_LEN) */
+#define BLE_OTAP_SEGMENT_PACKAGES 4096
+
+/** upload packages use the message ids of the fileupload partition
+ * (0x8000 - 0xFFFF). Package i of segment s has the message id
+ * BLE_OTAP_FIRST_MESSAGE_ID + (s % BLE_OTAP_SEGMENT_ID_RANGES) * BLE_OTAP_SEGMENT_PACKAGES + i,
+ * so late packages of the previous segment are not taken for the current one */
+#define BLE_OTAP_FIRST_MESSAGE_ID 0x8000
+#define BLE_OTAP_SEGMENT_ID_RANGES 8
+
+/** all other messages use the control ids 1 - BLE_CONTROL_MESSAGE_ID_MAX,
+ * so they never collide with upload packages. Every direction counts on its
+ * own and wraps to 1, ids are compared with serial number arithmetic
+ * (RFC 1982) over this range. The scan request starts the ids of the
+ * smartphone over */
+#define BLE_CONTROL_MESSAGE_ID_MAX (BLE_OTAP_FIRST_MESSAGE_ID - 1)
+
+/** ble_OTAP_FLAG_MULTI_SOURCE: smartphones sending parts of the same upload */
+#define BLE_OTAP_MAX_SOURCES 4
+
+/** ble_OTAP_FLAG_TURBO: the stack is started again, if no new upload package
+ * is received for this many seconds */
+#define BLE_OTAP_TURBO_TIMEOUT_S 30
+
+/** link adaption: average RSSI (dBm) and loss (per mille) of a good and of
+ * a fair link, everything worse is poor */
+#define BLE_LINK_RSSI_GOOD (-70)
+#define BLE_LINK_RSSI_FAIR (-85)
+#define BLE_LINK_LOSS_GOOD 50
+#define BLE_LINK_LOSS_FAIR 200
+
+/** beacons are sent in this interval */
+#define BLE_TX_INTERVAL_MS 100
+/** every message is sent this long, before the next one is sent */
+#define BLE_TX_DWELL_MS 250
 
 /** used in header */
 #define BLE_HEADER_PDU_TYPE 0x42                  // Non-connectable Beacon
 #define BLE_ADV_DATA_TYPE_MANUFACTURER 0xFF       // Manufacturer Data with varaible length
 #define BLE_ADV_DATA_TYPE_SERVICE_UUID 0x07       // Complete 128-Bit Service ID
+#define BLE_ADV_DATA_TYPE_SERVICE_UUID_INCOMPLETE 0x06 // Incomplete List of 128-Bit Service IDs
+#define BLE_ADV_DATA_TYPE_LOCAL_NAME_SHORT 0x08   // Shortened Local Name
+#define BLE_ADV_DATA_TYPE_LOCAL_NAME 0x09         // Complete Local Name
 #define BLE_COMPANY_ID 0x09EF                     // Steinel Solutions AG
 
 /** we can send up to 28 Bytes as payload
@@ -60,6 +98,26 @@
 /** total lenth of the payload (23), reduced by the BLE_HEADER_LEN  */
 #define BLE_ADV_PAYLOAD_LEN (BLE_ADV_TOTAL_LEN - BLE_ADV_HEADER_LEN)
 
+/** fragments (ble_adv_cmd_fragment_t): the last flag and the index mask */
+#define BLE_FRAGMENT_LAST 0x80
+#define BLE_FRAGMENT_INDEX_MASK 0x7F
+/** bytes of the message in one fragment */
+#define BLE_FRAGMENT_DATA_LEN (BLE_ADV_PAYLOAD_LEN - 1)
+/** largest reassembled message, header included */
+#define BLE_FRAGMENT_MAX_LEN 128
+/** a message is dropped, if its next fragment does not follow within this time */
+#define BLE_FRAGMENT_TIMEOUT_MS 2000
+
+/** compact data frame of an upload (see BLE_OTAP_PACKAGE_COMPACT), only the
+ * message id (2 Bytes) in front of the data. Its first bit is the file_transfer
+ * bit (id >= BLE_OTAP_FIRST_MESSAGE_ID), the command
+ * ble_ADV_CMD_OTAP_UPLOAD_REQUEST is implied, so the data gets one Byte more
+ * (13 Bytes on iOS, 25 Bytes on Android) */
+#define BLE_ADV_DATA_HEADER_LEN 2
+/** set in the package length of the begin upload request: the upload packages
+ * are sent as compact data frames */
+#define BLE_OTAP_PACKAGE_COMPACT 0x80
+
 /**
  *  Request or rsponse?
  */
@@ -80,12 +138,32 @@ typedef enum {
     ble_ADV_CMD_SCAN_REQUEST     = 0x02,
     ble_ADV_CMD_SCAN_RESPONSE    = (ble_ADV_CMD_SCAN_REQUEST | ble_ADV_CMD_TYPE_RESPONSE),
 
+    ble_ADV_CMD_PROBE_REQUEST    = 0x03,
+    ble_ADV_CMD_PROBE_RESPONSE   = (ble_ADV_CMD_PROBE_REQUEST | ble_ADV_CMD_TYPE_RESPONSE),
+
+    ble_ADV_CMD_STATS_REQUEST    = 0x04,
+    ble_ADV_CMD_STATS_RESPONSE   = (ble_ADV_CMD_STATS_REQUEST | ble_ADV_CMD_TYPE_RESPONSE),
+
     ble_ADV_CMD_OTAP_BEGIN_UPLOAD_REQUEST   = 0x0A,
     ble_ADV_CMD_OTAP_BEGIN_UPLOAD_RESPONSE  = (ble_ADV_CMD_OTAP_BEGIN_UPLOAD_REQUEST | ble_ADV_CMD_TYPE_RESPONSE),
 
     ble_ADV_CMD_OTAP_UPLOAD_REQUEST   = 0x0B,
     ble_ADV_CMD_OTAP_UPLOAD_RESPONSE  = (ble_ADV_CMD_OTAP_UPLOAD_REQUEST | ble_ADV_CMD_TYPE_RESPONSE),
+
+    ble_ADV_CMD_OTAP_PAGE_HASH_REQUEST   = 0x0C,
+    ble_ADV_CMD_OTAP_PAGE_HASH_RESPONSE  = (ble_ADV_CMD_OTAP_PAGE_HASH_REQUEST | ble_ADV_CMD_TYPE_RESPONSE),
+
+    ble_ADV_CMD_OTAP_KEEP_PAGES_REQUEST   = 0x0D,
+    ble_ADV_CMD_OTAP_KEEP_PAGES_RESPONSE  = (ble_ADV_CMD_OTAP_KEEP_PAGES_REQUEST | ble_ADV_CMD_TYPE_RESPONSE),
+
+    ble_ADV_CMD_FRAGMENT_REQUEST   = 0x0F,
+    ble_ADV_CMD_FRAGMENT_RESPONSE  = (ble_ADV_CMD_FRAGMENT_REQUEST | ble_ADV_CMD_TYPE_RESPONSE),
+
+    /** sent by the nodes of a multicast upload, there is no request */
+    ble_ADV_CMD_OTAP_NACK_RESPONSE  = (0x0E | ble_ADV_CMD_TYPE_RESPONSE),
 } ble_adv_cmd_e;
+/** request command codes are below, see Ble.cmd_count */
+#define BLE_ADV_CMD_REQUEST_CODES 0x10
 
 /**
  *    - [0:1]  message_id
@@ -105,14 +183,63 @@ typedef struct __attribute((packed)) {
 ble_adv_cmd_resend_message_rsp_t;
 #define BLE_ADV_CMD_RESEND_MESSAGE_RSP_LEN (BLE_ADV_HEADER_LEN + sizeof(ble_adv_cmd_resend_rsp_t))
 
+/**
+ *  Capabilities exchanged in the scan request and response, the connection
+ *  uses the ones both sides support
+ */
+typedef enum {
+    /** ble_OTAP_FLAG_COMPRESSED */
+    ble_CAP_COMPRESSED = 0x0001,
+    /** ble_OTAP_FLAG_DELTA */
+    ble_CAP_DELTA = 0x0002,
+    /** ble_OTAP_FLAG_KEEP_PAGES and the page hash request */
+    ble_CAP_KEEP_PAGES = 0x0004,
+    /** ble_OTAP_FLAG_IMAGE_CRC */
+    ble_CAP_IMAGE_CRC = 0x0008,
+    /** ble_OTAP_FLAG_DIRECT */
+    ble_CAP_DIRECT = 0x0010,
+    /** ble_OTAP_FLAG_TURBO */
+    ble_CAP_TURBO = 0x0020,
+    /** ble_OTAP_FLAG_MULTICAST */
+    ble_CAP_MULTICAST = 0x0040,
+    /** ble_OTAP_FLAG_MULTI_SOURCE */
+    ble_CAP_MULTI_SOURCE = 0x0080,
+    /** upload packages are compact data frames (BLE_ADV_DATA_HEADER_LEN),
+     * without BLE_OTAP_PACKAGE_COMPACT in the begin upload request */
+    ble_CAP_COMPACT = 0x0100,
+    /** missing packages are reported with ble_ADV_CMD_OTAP_NACK_RESPONSE
+     * instead of resend requests, also in a single upload */
+    ble_CAP_NACK = 0x0200,
+    /** iOS frames continue in the local name, see ble_rx_header_service_t */
+    ble_CAP_IOS_EXTENDED = 0x1000,
+    /** the package length of the begin upload request is the largest one of
+     * the app, the node chooses the length for the link, see
+     * ble_adv_cmd_otap_begin_upload_rsp_t */
+    ble_CAP_LINK_ADAPT = 0x2000,
+    /** messages larger than one advertisement, ble_adv_cmd_fragment_t, and
+     * ble_ADV_CMD_STATS_REQUEST */
+    ble_CAP_FRAGMENT = 0x4000,
+    /** link probe, ble_ADV_CMD_PROBE_REQUEST */
+    ble_CAP_PROBE = 0x8000,
+} ble_capability_e;
+
+/** capabilities of this firmware */
+#define BLE_CAPABILITIES (ble_CAP_COMPRESSED | ble_CAP_DELTA | ble_CAP_KEEP_PAGES | \
+                          ble_CAP_IMAGE_CRC | ble_CAP_DIRECT | ble_CAP_TURBO | \
+                          ble_CAP_MULTICAST | ble_CAP_MULTI_SOURCE | ble_CAP_COMPACT | \
+                          ble_CAP_NACK | ble_CAP_IOS_EXTENDED | ble_CAP_LINK_ADAPT | \
+                          ble_CAP_FRAGMENT | ble_CAP_PROBE)
+
 /**
  *  - request (from app):
  *    - [0] app version
  *    - [1] hardware os (0: android / 1: ios)
+ *    - [2:3] capabilities of the app @ref ble_capability_e (older apps send 0)
  */
 typedef struct __attribute((packed)) {
     uint8_t app_version;
     uint8_t hardware;
+    uint16_t capabilities;
 }
 ble_adv_cmd_scan_req_t;
 #define BLE_ADV_CMD_SCAN_REQ_LEN (BLE_ADV_HEADER_LEN + sizeof(ble_adv_cmd_scan_req_t))
@@ -123,6 +250,11 @@ ble_adv_cmd_scan_req_t;
  *    - [4]    firmware version major
  *    - [5]    firmware version minor
  *    - [6]    is sink (0: no / 1: yes)
+ *    - [7:8]  capabilities used in this connection, supported by both sides
+ *    - [9]    largest package length of an upload, which fits into a
+ *             frame of the smartphone (compact frames with ble_CAP_COMPACT)
+ *    - [10]   beacon interval in ms, BLE_TX_INTERVAL_MS
+ *    - [11:12] time every message is sent in ms, BLE_TX_DWELL_MS
  */
 typedef struct __attribute((packed)) {
     uint16_t request_id;
@@ -130,22 +262,165 @@ typedef struct __attribute((packed)) {
     uint8_t  firmware_version_major;
     uint8_t  firmware_version_minor;
     uint8_t  is_sink;
+    uint16_t capabilities;
+    uint8_t  max_package_length;
+    uint8_t  tx_interval_ms;
+    uint16_t tx_dwell_ms;
 }
 ble_adv_cmd_scan_rsp_t;
 #define BLE_ADV_CMD_SCAN_RSP_LEN (BLE_ADV_HEADER_LEN + sizeof(ble_adv_cmd_scan_rsp_t))
 
+/** bulk chunks of a probe, which are told apart for the duplicates */
+#define BLE_PROBE_CHUNKS 1024
+/** round trip times are counted in buckets, bucket i up to
+ * BLE_PROBE_RTT_FIRST_MS << i ms, the last one takes the rest */
+#define BLE_PROBE_RTT_BUCKETS 8
+#define BLE_PROBE_RTT_FIRST_MS 50
+
+/**
+ *  Modes of the link probe, it measures the advertising link without the
+ *  flash, to tell radio problems from a slow node
+ */
+typedef enum {
+    /** answered at once with a pong, which echoes the timestamps */
+    ble_PROBE_PING = 0,
+    /** clear the statistics, answered with the (empty) report */
+    ble_PROBE_RESET = 1,
+    /** dummy chunk of the bulk mode, counted only, no response */
+    ble_PROBE_CHUNK = 2,
+    /** answered with the statistics since the reset */
+    ble_PROBE_REPORT = 3,
+} ble_probe_mode_e;
+
 /**
  *  - request (from app):
- *    - [0:1]  token
+ *    - [0]    mode @ref ble_probe_mode_e
+ *    - [1:2]  sequence number, chunks are numbered from 0 after the reset
+ *    - [3:6]  ble_PROBE_PING: timestamp of the smartphone, echoed
+ *    - [7:10] ble_PROBE_PING: node timestamp of the last pong received, 0 if none
+ *    - [11:12] ble_PROBE_PING: ms from receiving that pong to sending this ping
+ *    - [3:x]  ble_PROBE_CHUNK: dummy data
+ *  the node takes the round trip time of the last pong from the ping
+ */
+typedef struct __attribute((packed)) {
+    uint8_t  mode;
+    uint16_t sequence;
+    uint32_t phone_time;
+    uint32_t node_time;
+    uint16_t hold_ms;
+}
+ble_adv_cmd_probe_req_t;
+#define BLE_ADV_CMD_PROBE_REQ_LEN (BLE_ADV_HEADER_LEN + sizeof(ble_adv_cmd_probe_req_t))
+/** mode and sequence number */
+#define BLE_ADV_CMD_PROBE_MIN_LEN (BLE_ADV_HEADER_LEN + 3)
+
+/**
+ *  - response to ble_PROBE_PING:
+ *    - [0:1]  requestId
+ *    - [2]    mode, ble_PROBE_PING
+ *    - [3:4]  sequence number of the ping
+ *    - [5:8]  timestamp of the smartphone from the ping
+ *    - [9:12] timestamp of the node (hp timestamp), echoed by the next ping
+ */
+typedef struct __attribute((packed)) {
+    uint16_t request_id;
+    uint8_t  mode;
+    uint16_t sequence;
+    uint32_t phone_time;
+    uint32_t node_time;
+}
+ble_adv_cmd_probe_pong_rsp_t;
+#define BLE_ADV_CMD_PROBE_PONG_RSP_LEN (BLE_ADV_HEADER_LEN + sizeof(ble_adv_cmd_probe_pong_rsp_t))
+
+/**
+ *  - response to ble_PROBE_RESET and ble_PROBE_REPORT:
+ *    - [0:1]  requestId
+ *    - [2]    mode of the request
+ *    - [3:4]  bulk chunks received
+ *    - [5:6]  bulk chunks lost (gaps up to the highest sequence number)
+ *    - [7:8]  bulk chunks received more than once
+ *    - [9:12] goodput of the bulk chunks in bytes/s, first to last chunk
+ *    - [13:20] round trip times of the pings per bucket, see
+ *             BLE_PROBE_RTT_BUCKETS (saturated at 255)
+ */
+typedef struct __attribute((packed)) {
+    uint16_t request_id;
+    uint8_t  mode;
+    uint16_t received;
+    uint16_t lost;
+    uint16_t duplicates;
+    uint32_t goodput;
+    uint8_t  rtt[BLE_PROBE_RTT_BUCKETS];
+}
+ble_adv_cmd_probe_report_rsp_t;
+#define BLE_ADV_CMD_PROBE_REPORT_RSP_LEN (BLE_ADV_HEADER_LEN + sizeof(ble_adv_cmd_probe_report_rsp_t))
+
+/**
+ *  Flags in the OTAP begin upload request
+ */
+typedef enum {
+    /** upload packages contain the scratchpad image as it is */
+    ble_OTAP_FLAG_NONE = 0x00,
+    /** upload packages contain the heatshrink (-w 8 -l 4) compressed image */
+    ble_OTAP_FLAG_COMPRESSED = 0x01,
+    /** upload packages contain a patch against the running application
+     * (firmware version from the scan response), see otap_stream.h */
+    ble_OTAP_FLAG_DELTA = 0x02,
+    /** do not erase the pages selected with ble_ADV_CMD_OTAP_KEEP_PAGES_REQUEST,
+     * their upload packages are not sent */
+    ble_OTAP_FLAG_KEEP_PAGES = 0x04,
+    /** the request carries the CRC32 of the scratchpad image, the upload is
+     * rejected with APP_RET_OTAP_IMAGE_CRC, if it does not match */
+    ble_OTAP_FLAG_IMAGE_CRC = 0x08,
+    /** stop the stack and write the packages straight into the scratchpad,
+     * no buffer area and one reboot less. The connection ends with a reboot
+     * in any case. Send the packages in order, only a few can be reordered */
+    ble_OTAP_FLAG_DIRECT = 0x10,
+    /** stop the stack for the upload, the scanner gets all radio time on all
+     * channels and less packages are lost. The stack is started again with
+     * the reboot at the end of the upload, if the upload fails or if no
+     * package is received for BLE_OTAP_TURBO_TIMEOUT_S (upload packages are
+     * not accepted anymore then, send a new begin upload request).
+     * The node is not reachable in the mesh meanwhile */
+    ble_OTAP_FLAG_TURBO = 0x20,
+    /** every node receiving the begin request joins the upload, the token is
+     * the transfer id chosen by the smartphone. The nodes report their gaps
+     * with ble_ADV_CMD_OTAP_NACK_RESPONSE instead of resend requests, the
+     * smartphone resends the union of the reported packages */
+    ble_OTAP_FLAG_MULTICAST = 0x40,
+    /** several smartphones send disjoint ranges of the same upload. The
+     * first begin request starts the upload, the same request with another
+     * token joins it and gets the upper half of the largest range still to
+     * send. A join in another data frame format (compact or not) is rejected
+     * with APP_RET_INVALID_PARAM. In every new segment, source k of n sends the packages from
+     * k * segment_packages / n (rounded down to OTAP_JOURNAL_GROUP_LEN).
+     * Every source ends its range with the last package of it, the node
+     * reports the gaps of the range with ble_ADV_CMD_OTAP_NACK_RESPONSE */
+    ble_OTAP_FLAG_MULTI_SOURCE = 0x80,
+} ble_otap_flag_e;
+
+/**
+ *  - request (from app):
+ *    - [0:1]  token of the node from the scan response, other nodes ignore
+ *             the request. Transfer id with ble_OTAP_FLAG_MULTICAST, token of
+ *             the source with ble_OTAP_FLAG_MULTI_SOURCE
  *    - [2]    scratchpad sequnce
  *    - [3:6]  scratchpad length
- *    - [7]    package length (every package must have same length, so we can avoid sending length information in each package, IOS will send 12 Bytes, Android 23 Bytes)
+ *    - [7]    package length (every package must have same length, so we can avoid sending length information in each package, IOS will send 12 Bytes, Android 23 Bytes),
+ *             or'ed with BLE_OTAP_PACKAGE_COMPACT for compact data frames
+ *    - [8]    flags @ref ble_otap_flag_e (older apps send 0)
+ *    - [9:12] stream length, number of bytes sent in upload packages (only used with ble_OTAP_FLAG_COMPRESSED / ble_OTAP_FLAG_DELTA)
+ *    - [13:16] CRC32 of the (decoded) scratchpad image, zlib compatible (only used with ble_OTAP_FLAG_IMAGE_CRC,
+ *              does not fit into an iOS frame)
  */
 typedef struct __attribute((packed)) {
     uint16_t token;
     uint8_t  scratchpad_sequence_number;
     uint32_t scratchpad_length;
     uint8_t  package_length;
+    uint8_t  flags;
+    uint32_t stream_length;
+    uint32_t image_crc;
 }
 ble_adv_cmd_otap_begin_upload_req_t;
 #define BLE_ADV_CMD_OTAP_BEGIN_UPLOAD_REQ_LEN (BLE_ADV_HEADER_LEN + sizeof(ble_adv_cmd_otap_begin_upload_req_t))
@@ -154,16 +429,40 @@ typedef enum {
     ble_STATUS_OTAP_OK = 0,
     ble_STATUS_OTAP_UPLOAD = 1,
     ble_STATUS_OTAP_ERR_OVERLOAD = 2,
+    /** all packages of the segment are received, continue with the next */
+    ble_STATUS_OTAP_SEGMENT_DONE = 3,
+    /** the upload failed, the reason is in the error field */
+    ble_STATUS_OTAP_ERR_FAILED = 4,
 } ble_status_otap_e;
 
 /**
  *    - [0:1] requestId
- *    - [2] response code (0-> success)
+ *    - [2:3] message id of the first upload package
+ *    - [4] response code (0-> success)
+ *    - [5:6] message id of the first package to send, an interrupted upload
+ *            of the same image continues there
+ *    - [7:8] segment of resume_message_id
+ *    - [9:10] token of the node, tells the nodes of a multicast upload apart
+ *    - [11:12] message id of the last package of the range to send
+ *    - [13]  source number, ble_OTAP_FLAG_MULTI_SOURCE
+ *    - [14]  package length for the link, used for the upload with
+ *            ble_CAP_LINK_ADAPT, otherwise a recommendation. An interrupted
+ *            upload continues with its length
+ *    - [15]  recommended number of times to send every package
+ *  a response code other than 0 rejects the upload (e.g. too big), no upload
+ *  package is accepted
  */
 typedef struct __attribute((packed)) {
     uint16_t request_id;
     uint16_t start_message_id;
     uint8_t  response_code;
+    uint16_t resume_message_id;
+    uint16_t segment;
+    uint16_t node_token;
+    uint16_t range_end_message_id;
+    uint8_t  source;
+    uint8_t  package_length;
+    uint8_t  repeat_count;
 }
 ble_adv_cmd_otap_begin_upload_rsp_t;
 #define BLE_ADV_CMD_OTAP_BEGIN_UPLOAD_RSP_LEN (BLE_ADV_HEADER_LEN + sizeof(ble_adv_cmd_otap_begin_upload_rsp_t))
@@ -179,16 +478,173 @@ ble_adv_cmd_otap_upload_req_t;
 
 /**
  *    - [0:1] requestId
- *    - [2] response code (0-> success)
+ *    - [2] response code @ref ble_status_otap_e
+ *    - [3] percentage
+ *    - [4:5] segment currently received
+ *    - [6:7] ble_STATUS_OTAP_SEGMENT_DONE: message id of the first package
+ *            to send in the new segment
+ *    - [8:9] token of the node
+ *    - [10:11] ble_STATUS_OTAP_UPLOAD: message id of the last package of the
+ *            range of the request, shrinks when a source joins
+ *    - [12]  number of sources, ble_OTAP_FLAG_MULTI_SOURCE
+ *    - [13]  ble_STATUS_OTAP_SEGMENT_DONE: recommended number of times to
+ *            send every package of the new segment, from the loss of the last
+ *            one (the package length stays, journal and resume depend on it)
+ *    - [14]  ble_STATUS_OTAP_ERR_FAILED: error code @ref error.h
  */
 typedef struct __attribute((packed)) {
     uint16_t request_id;
     uint8_t  response_code;
     uint8_t  percentage;
+    uint16_t segment;
+    uint16_t next_message_id;
+    uint16_t node_token;
+    uint16_t range_end_message_id;
+    uint8_t  num_sources;
+    uint8_t  repeat_count;
+    uint8_t  error;
 }
 ble_adv_cmd_otap_upload_rsp_t;
 #define BLE_ADV_CMD_OTAP_UPLOAD_RSP_LEN (BLE_ADV_HEADER_LEN + sizeof(ble_adv_cmd_otap_upload_rsp_t))
 
+/**
+ *  - request (from app):
+ *    - [0:1]  token
+ */
+typedef struct __attribute((packed)) {
+    uint16_t token;
+}
+ble_adv_cmd_otap_page_hash_req_t;
+#define BLE_ADV_CMD_OTAP_PAGE_HASH_REQ_LEN (BLE_ADV_HEADER_LEN + sizeof(ble_adv_cmd_otap_page_hash_req_t))
+
+/** number of page hashes in one response */
+#define BLE_OTAP_PAGE_HASHES_PER_RSP 4
+/** execution time of the task hashing the pages of one response */
+#define BLE_OTAP_PAGE_HASH_EXEC_TIME_US 5000
+
+/** one response for every BLE_OTAP_PAGE_HASHES_PER_RSP pages in the buffer
+ *    - [0:1]   requestId
+ *    - [2:3]   page size
+ *    - [4:5]   header size (page n holds stream bytes from n * page size - header size)
+ *    - [6]     number of pages
+ *    - [7]     first page in this response
+ *    - [8:23]  CRC32 of the stream bytes in the pages
+ */
+typedef struct __attribute((packed)) {
+    uint16_t request_id;
+    uint16_t page_size;
+    uint16_t header_size;
+    uint8_t  num_pages;
+    uint8_t  first_page;
+    uint32_t hash[BLE_OTAP_PAGE_HASHES_PER_RSP];
+}
+ble_adv_cmd_otap_page_hash_rsp_t;
+#define BLE_ADV_CMD_OTAP_PAGE_HASH_RSP_LEN (BLE_ADV_HEADER_LEN + sizeof(ble_adv_cmd_otap_page_hash_rsp_t))
+
+/**
+ *  - request (from app), send before the begin upload request with ble_OTAP_FLAG_KEEP_PAGES:
+ *    - [0:1]  token
+ *    - [2:5]  one bit per page with matching hash
+ *    - [6]    page of bit 0 (older apps send 0), send one request per 32 pages
+ */
+typedef struct __attribute((packed)) {
+    uint16_t token;
+    uint32_t keep_pages;
+    uint8_t  first_page;
+}
+ble_adv_cmd_otap_keep_pages_req_t;
+#define BLE_ADV_CMD_OTAP_KEEP_PAGES_REQ_LEN (BLE_ADV_HEADER_LEN + sizeof(ble_adv_cmd_otap_keep_pages_req_t))
+
+/**
+ *    - [0:1] requestId
+ *    - [2] response code (0-> success)
+ */
+typedef struct __attribute((packed)) {
+    uint16_t request_id;
+    uint8_t  response_code;
+}
+ble_adv_cmd_otap_keep_pages_rsp_t;
+#define BLE_ADV_CMD_OTAP_KEEP_PAGES_RSP_LEN (BLE_ADV_HEADER_LEN + sizeof(ble_adv_cmd_otap_keep_pages_rsp_t))
+
+/** packages covered by one ble_ADV_CMD_OTAP_NACK_RESPONSE */
+#define BLE_OTAP_NACK_PACKAGES 96
+
+/** multicast upload: sent instead of a resend request, when the last package
+ * of the segment is received and packages are missing
+ *    - [0:1]  transfer id
+ *    - [2:3]  token of the node
+ *    - [4:5]  segment
+ *    - [6:7]  message id of the first missing package
+ *    - [8:19] one bit per package from the first missing one, set if missing
+ *  packages behind are reported after the next completion check
+ */
+typedef struct __attribute((packed)) {
+    uint16_t transfer_id;
+    uint16_t node_token;
+    uint16_t segment;
+    uint16_t first_message_id;
+    uint8_t  missing[BLE_OTAP_NACK_PACKAGES / 8];
+}
+ble_adv_cmd_otap_nack_rsp_t;
+#define BLE_ADV_CMD_OTAP_NACK_RSP_LEN (BLE_ADV_HEADER_LEN + sizeof(ble_adv_cmd_otap_nack_rsp_t))
+
+/**
+ *  - request (from app) or response: part of a message larger than one advertisement
+ *    - [0]    bit 0-6: index of the fragment, 0 starts a new message
+ *             bit 7: BLE_FRAGMENT_LAST
+ *    - [1:x]  next bytes of the message, which starts with its own header
+ *             (message id, command), followed by the payload
+ *  fragments are sent in order, one after the other. A gap or a pause longer
+ *  than BLE_FRAGMENT_TIMEOUT_MS drops the message, it has to be sent again.
+ *  The padding of iOS frames becomes part of the message.
+ */
+typedef struct __attribute((packed)) {
+    uint8_t fragment;
+    uint8_t data[BLE_FRAGMENT_DATA_LEN];
+}
+ble_adv_cmd_fragment_t;
+
+/** clear the counters, after they are sent */
+#define BLE_STATS_RESET 0x01
+
+/**
+ *  - request (from app): counters of the node, needs ble_CAP_FRAGMENT
+ *    - [0]    flags, BLE_STATS_RESET
+ */
+typedef struct __attribute((packed)) {
+    uint8_t flags;
+}
+ble_adv_cmd_stats_req_t;
+#define BLE_ADV_CMD_STATS_REQ_LEN (BLE_ADV_HEADER_LEN + sizeof(ble_adv_cmd_stats_req_t))
+
+/**
+ *  - response: larger than one advertisement, sent in
+ *    ble_ADV_CMD_FRAGMENT_RESPONSE fragments (see ble_stats_message_t)
+ *    - [0:1]  requestId
+ *    - [2:3]  rejected requests
+ *    - [4:5]  average RSSI of the requests
+ *    - [6:7]  requests received since the scan request
+ *    - [8:9]  requests lost since the scan request
+ *    - [10:41] handled requests per command code
+ */
+typedef struct __attribute((packed)) {
+    uint16_t request_id;
+    uint16_t cmd_rejected;
+    int16_t  link_rssi;
+    uint16_t link_received;
+    uint16_t link_lost;
+    uint16_t cmd_count[BLE_ADV_CMD_REQUEST_CODES];
+}
+ble_adv_cmd_stats_rsp_t;
+
+/** the statistics response with its header, does not fit into ble_adv_cmd_t */
+typedef struct __attribute((packed)) {
+    uint16_t message_id;
+    uint8_t command;
+    ble_adv_cmd_stats_rsp_t stats_rsp;
+}
+ble_stats_message_t;
+
 typedef struct  __attribute__ ((packed)) {
     /** this includes the encrypted and last flag */
     uint16_t message_id;
@@ -203,6 +659,16 @@ typedef struct  __attribute__ ((packed)) {
         ble_adv_cmd_otap_begin_upload_rsp_t otap_begin_upload_rsp;
         ble_adv_cmd_otap_upload_req_t otap_upload_req;
         ble_adv_cmd_otap_upload_rsp_t otap_upload_rsp;
+        ble_adv_cmd_otap_page_hash_req_t otap_page_hash_req;
+        ble_adv_cmd_otap_page_hash_rsp_t otap_page_hash_rsp;
+        ble_adv_cmd_otap_keep_pages_req_t otap_keep_pages_req;
+        ble_adv_cmd_otap_keep_pages_rsp_t otap_keep_pages_rsp;
+        ble_adv_cmd_otap_nack_rsp_t otap_nack_rsp;
+        ble_adv_cmd_fragment_t fragment;
+        ble_adv_cmd_stats_req_t stats_req;
+        ble_adv_cmd_probe_req_t probe_req;
+        ble_adv_cmd_probe_pong_rsp_t probe_pong_rsp;
+        ble_adv_cmd_probe_report_rsp_t probe_report_rsp;
     }
     payload;
 }
@@ -237,6 +703,13 @@ ble_rx_header_manufacturer_t;
 
 /**
  * @brief Common beacon header used in Unit Tests
+ *
+ * iOS apps can only advertise service UUIDs and the local name. The frame
+ * is the content of a single 128-bit service UUID (0x06 / 0x07, byte order
+ * reversed), followed by the local name (0x08 / 0x09) taken as it is, up to
+ * BLE_IOS_EXTENDED_FRAME_LEN. The UUID alone is the basic frame. Other AD
+ * structures than flags and tx power mark the advertisement of another
+ * device.
  */
 typedef struct __attribute((packed)) {
     uint8_t nid[6];
@@ -246,6 +719,12 @@ typedef struct __attribute((packed)) {
     uint8_t ad_data_type;
 }
 ble_rx_header_service_t;
+/** frame of an iOS advertisement: one UUID, with ble_CAP_IOS_EXTENDED up to
+ * 8 more bytes in the local name */
+#define BLE_IOS_FRAME_LEN 16
+#define BLE_IOS_EXTENDED_FRAME_LEN 24
+/** hardware in the scan request */
+#define BLE_HARDWARE_IOS 1
 
 typedef enum {
     ble_OTAP_STATE_IDLE = 0,
@@ -253,21 +732,99 @@ typedef enum {
     ble_OTAP_STATE_FAILED = 2
 } ble_otap_state_t;
 
+/**
+ * @brief smartphone sending a part of the upload
+ */
+typedef struct {
+    /** token of its begin request */
+    uint16_t token;
+    /** packages of the current segment sent by it, first up to end (excluded) */
+    uint16_t first;
+    uint16_t end;
+}
+ble_otap_source_t;
+
 /**
  * @brief OTAP transfer state
  */
 typedef struct {
     uint8_t scratchpad_seqeunce_number;
+    /** size of the scratchpad image */
     uint32_t scratchpad_length;
+    /** @ref ble_otap_flag_e */
+    uint8_t flags;
+    /** bytes transferred in upload packages, differs from scratchpad_length if compressed */
+    uint32_t stream_length;
+    /** CRC32 of the scratchpad image, if ble_OTAP_FLAG_IMAGE_CRC is set */
+    uint32_t image_crc;
     uint8_t adv_package_length;
+    /** package length of the begin request, the largest one of the app */
+    uint8_t requested_package_length;
+    /** recommended number of times every package is sent */
+    uint8_t repeat_count;
+    /** the first completion check of the segment is done, packages missing
+     * then (per mille) */
+    bool segment_checked;
+    uint16_t segment_loss;
+    /** upload packages are compact data frames, BLE_OTAP_PACKAGE_COMPACT */
+    bool compact;
+    /** packages in the whole upload */
+    uint32_t total_messages;
+    /** number of segments, see BLE_OTAP_SEGMENT_PACKAGES */
+    uint16_t num_segments;
+    /** segment currently received */
+    uint16_t segment;
+    /** message ids of the current segment */
     uint16_t start_message_id;
     uint16_t end_message_id;
-    uint16_t total_messages;
-    uint8_t messageReceived[BLE_OTAP_MAX_NUMBER_OF_PACKAGES/8];
+    /** packages in the current segment */
+    uint16_t segment_messages;
+    /** one bit per package of the current segment */
+    uint8_t messageReceived[BLE_OTAP_SEGMENT_PACKAGES/8];
     ble_otap_state_t state;
+    /** ble_OTAP_FLAG_MULTICAST: token of the begin request */
+    uint16_t transfer_id;
+    /** smartphones sending the upload, one without ble_OTAP_FLAG_MULTI_SOURCE */
+    ble_otap_source_t sources[BLE_OTAP_MAX_SOURCES];
+    uint8_t num_sources;
+    /** ble_OTAP_FLAG_TURBO: the stack is stopped for this upload */
+    bool turbo;
+    /** ble_OTAP_FLAG_DIRECT: the upload goes into the scratchpad, false if
+     * the stack could not be stopped and the buffer is used instead */
+    bool direct;
+    /** timestamps in seconds of the begin request and the last new package */
+    int64_t begin_s;
+    int64_t last_package_s;
+    /** new packages received since the begin request, for the throughput */
+    uint32_t received_packages;
+    /** last package of the upload, answered when Otap_bufferEnd() is done */
+    uint16_t end_request_id;
+    /** page hash request answered in the background, next page to hash */
+    uint16_t hash_request_id;
+    uint16_t hash_next_page;
 }
 ble_otap_t;
 
+/**
+ * @brief statistics of the link probe since ble_PROBE_RESET
+ */
+typedef struct {
+    /** bulk chunks, the distinct ones and those received again */
+    uint16_t received;
+    uint16_t duplicates;
+    /** highest sequence number + 1 */
+    uint16_t end;
+    /** one bit per chunk */
+    uint8_t chunks[BLE_PROBE_CHUNKS / 8];
+    /** dummy bytes of the distinct chunks and their first and last arrival */
+    uint32_t bytes;
+    app_lib_time_timestamp_hp_t first;
+    app_lib_time_timestamp_hp_t last;
+    /** round trip times of the pings, see BLE_PROBE_RTT_BUCKETS */
+    uint8_t rtt[BLE_PROBE_RTT_BUCKETS];
+}
+ble_probe_t;
+
 typedef struct Ble Ble_context;
 
 typedef enum {
@@ -314,10 +871,14 @@ struct Ble {
 
     /** used to store the current state of the OTAP transfer */
     ble_otap_t otap;
+    /** link probe statistics */
+    ble_probe_t probe;
 
-    /** used as a counter to close a connection, if no data since xxx ms */
+    /** last control message id received from the smartphone */
     uint16_t last_received_message_id;
-    /** last sent message id */
+    /** last upload package id received, 0 if none since the scan request */
+    uint16_t last_received_data_id;
+    /** last sent message id, a control id */
     uint16_t message_id;
 
     /** used in otap process to wait for incoming messages */
@@ -334,6 +895,20 @@ struct Ble {
     int64_t connected_device_last_ping_s;
     /** generated after Scan Request, and used to filter incoming messages */
     uint16_t connected_token;
+    /** capabilities agreed in the scan handshake @ref ble_capability_e,
+     * 0 for older apps */
+    uint16_t capabilities;
+    /** largest frame the smartphone can send, from its hardware */
+    uint8_t max_frame_len;
+    /** link quality since the scan request: average RSSI of the received
+     * frames, received and lost requests (gaps in the message ids) */
+    int16_t link_rssi;
+    uint16_t link_received;
+    uint16_t link_lost;
+    /** handled requests per command code, and the rejected ones (unknown,
+     * too short, out of the upload, for another node) */
+    uint16_t cmd_count[BLE_ADV_CMD_REQUEST_CODES];
+    uint16_t cmd_rejected;
 
 };
 
@@ -354,6 +929,19 @@ extern void Ble_createStatic(Ble_context* const ble_context_p,
     app_settings_t* app_settings_p);
 
 
+/** @brief send a message larger than one advertisement
+ *
+ * The message is queued in ble_ADV_CMD_FRAGMENT_RESPONSE fragments, sent
+ * in one burst.
+ *
+ * @param[in, out] ble_context_p Pointer to the instance
+ * @param data message, starting with its header (message id, command)
+ * @param len length of the message
+ * @return error code @ref error.h
+ */
+extern uint32_t Ble_sendFragmented(Ble_context* const ble_context_p,
+    const uint8_t* data, uint16_t len);
+
 /** @brief Destroy BLE main state machine
  *
  * Use this function to cleanup the static allocated instance
@@ -20,6 +20,8 @@
 #include "app_app.h"
 
 #include "otap.h"
+#include "crc.h"
+#include "flash.h"
 #define DEBUG_LOG_MODULE_NAME "OTAP"
 #ifdef DEBUG_APP_LOG_MAX_LEVEL
 #define DEBUG_LOG_MAX_LEVEL DEBUG_APP_LOG_MAX_LEVEL
@@ -30,12 +32,72 @@
 
 // from pca10100_scratchpad.ini file
 #define OTAP_PERSISTENT_MEMORY_AREA_ID 0x8AE573BB
+// from pca10100_scratchpad.ini file, memory mapped, if in internal flash
+#define OTAP_PERSISTENT_MEMORY_AREA_ADDRESS 0x00076000
+
+// from pca10100_scratchpad.ini file, running application, base of delta uploads
+#define OTAP_APPLICATION_AREA_ADDRESS 0x00040000
+#define OTAP_APPLICATION_AREA_LENGTH 188416
 
 // Randomly generated to consider area correctly initialized
 #define OTAP_PERSISTENT_MAGIC 0x1E7B3ABA
 #define BLOCK_SIZE 512
+
+/** Header in front of the uploaded data
+ *  !!! DO NOT remove any field previously defined
+ *  New fields shall be added at the end of the structure
+ */
+typedef struct __attribute__ ((packed)) {
+    uint32_t magic;
+    /** size of the scratchpad image */
+    uint32_t image_length;
+    uint8_t sequence;
+    /** @ref otap_encoding_e */
+    uint8_t encoding;
+    /** uploaded bytes, differs from image_length if encoded */
+    uint32_t stream_length;
+    uint8_t package_length;
+    /** OTAP_MANIFEST_MAGIC, written in Otap_bufferBegin() */
+    uint32_t manifest_magic;
+    /** @ref otap_manifest_t */
+    uint8_t check_image_crc;
+    uint32_t image_crc;
+} otap_buffer_header_t;
+
+/** The header is followed by one entry per page, set when the erase of the
+ * page for the upload is done, so a resumed upload knows the pages still to
+ * erase. They are kept in the first page, which is always erased first.
+ * Then follows the journal, one uint32_t per group of
+ * OTAP_JOURNAL_GROUP_LEN packages. The entry is erased (0xFFFFFFFF) till
+ * all packages of the group are written, then set to 0. Every entry is
+ * written once only, as the flash allows only a few writes per word.
+ * The journal is sized in Otap_init() for the smallest packages filling
+ * the whole area.
+ * Behind the journal, OTAP_PROCESS_MAX_ATTEMPTS entries of the same kind
+ * count the calls of Otap_process(), one is set at every call. The last
+ * entry is set, when the scratchpad is written and activated.
+ */
+#define OTAP_JOURNAL_DONE 0x00000000
+
+/** one bit per page */
+#define PAGE_SET_WORDS ((OTAP_MAX_PAGES + 31) / 32)
+typedef uint32_t page_set_t[PAGE_SET_WORDS];
+
+/** buffer was erased by Otap_bufferBegin() of this firmware, the layout
+ * behind the header changed with the erase entries */
+#define OTAP_MANIFEST_MAGIC 0x4D414E32
+
 /** buffer used in lib_memory_area->startWrite()  */
 uint8_t m_buffer_block_write[BLOCK_SIZE];
+/** buffers used to read the stored stream in Otap_process(), one is read
+ * while the other one is decoded and written to the scratchpad */
+static uint8_t m_buffer_block_read[2][BLOCK_SIZE];
+/** decodes the stored stream in Otap_process() */
+static otap_stream_t m_stream;
+/** a delta upload has to start with the full version of the running firmware
+ */
+static const uint8_t m_base_version[OTAP_DELTA_HEADER_LEN] = {
+    VER_MAJOR, VER_MINOR, VER_MAINT, VER_DEV};
 /** used to hold data, till its been written, memcpy to otap_buffer_block_write
  */
 /* uint8_t m_buffer_block_cache[BLOCK_SIZE]; */
@@ -51,216 +113,856 @@ static size_t m_usable_memory_size;
 
 static app_lib_mem_area_info_t m_memory_area;
 
-static bool active_wait_for_end_of_operation(int32_t timeout_us) {
-  app_lib_time_timestamp_hp_t timeout_end;
-  bool busy, timeout_reached;
+/** number of erase sectors (pages) in the buffer area */
+static size_t m_num_pages;
 
-  timeout_end =
-      lib_time->addUsToHpTimestamp(lib_time->getTimestampHp(), timeout_us);
+/** number of journal entries */
+static size_t m_journal_len;
 
-  /* Wait for flash to be ready */
-  do {
-    busy = lib_memory_area->isBusy(OTAP_PERSISTENT_MEMORY_AREA_ID);
-    timeout_reached =
-        lib_time->isHpTimestampBefore(timeout_end, lib_time->getTimestampHp());
-  } while (busy == true && !timeout_reached);
+/** pages selected with Otap_keepPages() for the next Otap_bufferBegin() */
+static page_set_t m_select_pages;
 
-  return !busy;
-}
+/** pages left untouched in Otap_bufferBegin() */
+static page_set_t m_keep_pages;
+
+/** upload in progress, set by Otap_bufferBegin() / Otap_bufferResume() */
+static otap_manifest_t m_manifest;
+
+/** pages, which have to be erased before the upload can write to them */
+static page_set_t m_erase_pages;
+
+/** pages queued for erase and not yet done */
+static page_set_t m_erase_queued;
 
-static bool write(uint32_t to, void* from, size_t amount) {
-  int32_t timeout_us;
+/** upload continued with Otap_bufferResume(), after Otap_bufferBegin() the
+ * journal is empty and being erased */
+static bool m_resumed;
 
-  if (lib_memory_area->startWrite(OTAP_PERSISTENT_MEMORY_AREA_ID, to, from,
-                                 amount) != APP_LIB_MEM_AREA_RES_OK) {
+/** upload streamed straight into the scratchpad, see Otap_directBegin() */
+static struct {
+  bool active;
+  otap_manifest_t manifest;
+  /** lib_otap->write block size */
+  size_t block_size;
+  /** CRC32 of the decoded image so far */
+  uint32_t image_crc;
+  /** next package to feed into the decoder */
+  uint32_t next_package;
+  /** packages received ahead of next_package, slot = package % window */
+  uint8_t window[OTAP_DIRECT_WINDOW][OTAP_DIRECT_PACKAGE_LEN];
+  uint32_t present[(OTAP_DIRECT_WINDOW + 31) / 32];
+} m_direct;
+
+/** first error of the queued flash operations of the upload */
+static int m_flash_error;
+
+/** @brief blocking read, for the few places which need the data now */
+static bool read(void *to, uint32_t from, size_t amount) {
+  if (Flash_read(to, from, amount, NULL, NULL) != APP_RET_OK) {
     return false;
   }
+  return Flash_flush() == APP_RET_OK;
+}
 
-  timeout_us = ((m_memory_area.flash.byte_write_time +
-              m_memory_area.flash.byte_write_call_time) *
-             amount) *
-            2;
+/** @brief access stored bytes, internal flash is read in place
+ *
+ * @param buffer external flash is read into it, amount bytes, can be NULL
+ *        for internal flash
+ * @return pointer to the bytes, valid till the next call, NULL on error
+ */
+static const uint8_t *view(uint32_t from, size_t amount, uint8_t *buffer) {
+  if (m_memory_area.external_flash) {
+    return read(buffer, from, amount) ? buffer : NULL;
+  }
 
-  /* Wait end of read */
-  return active_wait_for_end_of_operation(timeout_us);
+  // queued writes have to be in the flash
+  if (!Flash_isIdle() && Flash_flush() != APP_RET_OK) {
+    return NULL;
+  }
+  return (const uint8_t *)(uintptr_t)(OTAP_PERSISTENT_MEMORY_AREA_ADDRESS + from);
 }
 
-static bool read(void *to, uint32_t from, size_t amount) {
-  int32_t timeout_us;
+/** @brief remember the first error, Otap_bufferEnd() reports it */
+static void flash_done(int result, void *cb_ctx) {
+  if (result != APP_RET_OK && m_flash_error == APP_RET_OK) {
+    m_flash_error = result;
+  }
+}
 
-  if (lib_memory_area->startRead(OTAP_PERSISTENT_MEMORY_AREA_ID, to, from,
-                                 amount) != APP_LIB_MEM_AREA_RES_OK) {
-    return false;
+static bool page_test(const uint32_t *set, uint32_t page) {
+  return (set[page / 32] & (1UL << (page % 32))) != 0;
+}
+
+static void page_set(uint32_t *set, uint32_t page) {
+  set[page / 32] |= 1UL << (page % 32);
+}
+
+static void page_clear(uint32_t *set, uint32_t page) {
+  set[page / 32] &= ~(1UL << (page % 32));
+}
+
+/** @return lowest page in the set, -1 if empty */
+static int32_t page_first(const uint32_t *set) {
+  for (uint32_t i = 0; i < PAGE_SET_WORDS; i++) {
+    if (set[i] != 0) {
+      return i * 32 + __builtin_ctz(set[i]);
+    }
   }
+  return -1;
+}
 
-  /* Compute timeout depending of external/internal flash */
-  if (m_memory_area.external_flash) {
-    // Most of time for external flash is on bus (SPI or I2C)
-    // And probably already spent in StartRead.
-    // Take a large timeout that should never be reached
-    timeout_us = 100000; // 100ms
-  } else {
-    // Read access in internal flash are synchronous
-    timeout_us = 0;
+/** @brief round up to the write alignment of the flash */
+static size_t align(size_t size) {
+  size_t alignment = m_memory_area.flash.write_alignment;
+
+  if (alignment > 1) {
+    size += alignment - 1;
+    size -= size % alignment;
   }
+  return size;
+}
+
+/** @brief journal entries have to be writable one by one */
+static size_t journal_entry_size(void) {
+  return m_memory_area.flash.write_alignment > sizeof(uint32_t)
+             ? m_memory_area.flash.write_alignment
+             : sizeof(uint32_t);
+}
+
+/** @brief offset of the entry telling that the page is erased */
+static size_t erased_offset(uint32_t page) {
+  size_t entry_size = journal_entry_size();
+
+  return (sizeof(otap_buffer_header_t) + entry_size - 1) / entry_size *
+             entry_size +
+         page * entry_size;
+}
 
-  /* Wait end of read */
-  return active_wait_for_end_of_operation(timeout_us);
+static size_t journal_offset(void) {
+  return erased_offset(m_num_pages);
+}
+
+/** @brief offset of the entry counting the given Otap_process() call */
+static size_t attempt_offset(uint32_t attempt) {
+  return journal_offset() + (m_journal_len + attempt) * journal_entry_size();
+}
+
+/** @brief offset of the entry set, when the scratchpad is activated */
+static size_t copied_offset(void) {
+  return attempt_offset(OTAP_PROCESS_MAX_ATTEMPTS);
 }
 
 int Otap_init(void) {
+  size_t area_size;
+
   if (m_initialized) {
     return APP_RET_OK;
   }
 
-  if (lib_memory_area->getAreaInfo(OTAP_PERSISTENT_MEMORY_AREA_ID,
-                                   &m_memory_area) != APP_LIB_MEM_AREA_RES_OK) {
+  if (Flash_init(OTAP_PERSISTENT_MEMORY_AREA_ID, &m_memory_area) !=
+      APP_RET_OK) {
     return APP_PERSISTENT_RES_NO_AREA;
   }
 
-  // Header size must be at least 3*uint32_t (magic_size + data_len + sequence)
-  // size and a multiple of writable flash size to keep next region alligned
-  // too. We assume that write_aligment is either lower than sizeof(uint32_t) or
-  // a multiple of it.
-  m_header_size = m_memory_area.flash.write_alignment > 3 * sizeof(uint32_t)
-                      ? m_memory_area.flash.write_alignment
-                      : 3 * sizeof(uint32_t);
+  // header and journal writes are copied into the flash queue
+  if (m_memory_area.flash.write_alignment > FLASH_WRITE_COPY_LEN) {
+    return APP_RET_NOT_SUPPORTED;
+  }
 
-  m_usable_memory_size = m_memory_area.area_size - m_header_size;
+  // only whole sectors can be erased
+  m_num_pages = m_memory_area.area_size / m_memory_area.flash.erase_sector_size;
+  if (m_num_pages > OTAP_MAX_PAGES) {
+    m_num_pages = OTAP_MAX_PAGES;
+  }
+  area_size = m_num_pages * m_memory_area.flash.erase_sector_size;
+
+  // the erase entries have to be in the first page
+  if (erased_offset(m_num_pages) > m_memory_area.flash.erase_sector_size) {
+    return APP_RET_NOT_SUPPORTED;
+  }
+
+  m_journal_len = (area_size / OTAP_MIN_PACKAGE_LENGTH + OTAP_JOURNAL_GROUP_LEN - 1) /
+                  OTAP_JOURNAL_GROUP_LEN;
+
+  // Header size must be at least sizeof(otap_buffer_header_t) + journal and a
+  // multiple of writable flash size to keep next region alligned too.
+  m_header_size = align(copied_offset() + journal_entry_size());
+  if (m_header_size >= area_size) {
+    return APP_PERSISTENT_RES_NO_AREA;
+  }
+
+  m_usable_memory_size = area_size - m_header_size;
 
   m_initialized = true;
   return APP_RET_OK;
 }
 
-int Otap_bufferBegin() {
+static void page_erased(int result, void *cb_ctx);
+
+/** @brief queue the erase of a page, if it is still to be erased */
+static int queue_erase(uint32_t page) {
+  int ret;
+
+  if (!page_test(m_erase_pages, page)) {
+    return APP_RET_OK;
+  }
+
+  ret = Flash_erase(page, page_erased, (void *)(uintptr_t)page);
+  if (ret == APP_RET_OK) {
+    page_clear(m_erase_pages, page);
+    page_set(m_erase_queued, page);
+  }
+  return ret;
+}
+
+/** @brief queue the erase of the pages holding the given range */
+static int queue_erase_range(uint32_t from, size_t len) {
+  size_t erase_page_size = m_memory_area.flash.erase_sector_size;
+  int ret = APP_RET_OK;
+
+  for (uint32_t page = from / erase_page_size;
+       page <= (from + len - 1) / erase_page_size && page < m_num_pages &&
+       ret == APP_RET_OK;
+       page++) {
+    ret = queue_erase(page);
+  }
+  return ret;
+}
+
+/** @brief set the erase entry of the page, see erased_offset() */
+static void mark_erased(uint32_t page) {
+  uint8_t entry[FLASH_WRITE_COPY_LEN];
+
+  memset(entry, 0xFF, journal_entry_size());
+  memset(entry, 0x00, sizeof(uint32_t));
+  if (Flash_write(erased_offset(page), entry, journal_entry_size(), flash_done,
+                  NULL) != APP_RET_OK) {
+    // a resumed upload erases the page again, if nothing is journaled in it
+    LOG(LVL_DEBUG, "erase entry of page %u lost", page);
+  }
+}
+
+/** @brief erase the pages of the upload one after the other, lowest first,
+ * as the smartphone sends the packages in this order
+ *
+ * Only one background erase is queued at a time, so writes are not delayed
+ * by all erases.
+ */
+static void page_erased(int result, void *cb_ctx) {
+  int32_t page;
+
+  page_clear(m_erase_queued, (uint32_t)(uintptr_t)cb_ctx);
+  flash_done(result, NULL);
+  // the erase just left the queue, its slot takes the entry
+  if (result == APP_RET_OK) {
+    mark_erased((uint32_t)(uintptr_t)cb_ctx);
+  }
+
+  page = page_first(m_erase_pages);
+
+  if (page >= 0 && queue_erase(page) != APP_RET_OK) {
+    // queue is full of writes, Otap_bufferWrite() queues the erase in front
+    // of the write to a page
+    LOG(LVL_DEBUG, "erase postponed");
+  }
+}
+
+void Otap_keepPages(uint8_t first_page, uint32_t pages) {
+  for (uint32_t i = 0; i < 32; i++) {
+    if ((pages & (1UL << i)) && first_page + i < m_num_pages) {
+      page_set(m_select_pages, first_page + i);
+    }
+  }
+}
+
+int Otap_bufferBegin(const otap_manifest_t *manifest, bool keep_pages) {
   size_t erase_page_size = m_memory_area.flash.erase_sector_size;
-  uint32_t sector_base = 0;
-  uint32_t timeout;
-  // Erase the minimum number of blocks for a given area
-  size_t num_page = (m_usable_memory_size / erase_page_size);
-  // Copy it as next function will update it
-  size_t num_page_temp = num_page;
-  // reset the block counter for the write method
-  /* m_write_block_number = 0; */
+  uint32_t stream_length = manifest->stream_length;
+  uint32_t last_page = (m_header_size + stream_length - 1) / erase_page_size;
+  uint32_t num_packages;
+  int ret = APP_RET_OK;
 
   if (!m_initialized) {
     return APP_PERSISTENT_RES_UNINITIALIZED;
   }
 
-  if (lib_memory_area->startErase(OTAP_PERSISTENT_MEMORY_AREA_ID, &sector_base,
-                                  &num_page_temp) != APP_LIB_MEM_AREA_RES_OK) {
-    return APP_PERSISTENT_RES_FLASH_ERROR;
+  if (manifest->package_length == 0) {
+    return APP_RET_INVALID_PARAM;
+  }
+
+  num_packages = (stream_length + manifest->package_length - 1) /
+                 manifest->package_length;
+  if (stream_length > m_usable_memory_size || last_page >= m_num_pages ||
+      num_packages > m_journal_len * OTAP_JOURNAL_GROUP_LEN) {
+    return APP_PERSISTENT_RES_TOO_BIG;
   }
 
-  // Determine the timeout dynamically with 100% margin (x2)
-  timeout = (m_memory_area.flash.sector_erase_time * num_page) * 2;
+  if (keep_pages) {
+    memcpy(m_keep_pages, m_select_pages, sizeof(m_keep_pages));
+  } else {
+    memset(m_keep_pages, 0, sizeof(m_keep_pages));
+  }
+  memset(m_select_pages, 0, sizeof(m_select_pages));
+
+  // operations of an earlier upload are finished first, pages erased by
+  // them are not kept
+  memset(m_erase_pages, 0, sizeof(m_erase_pages));
+  for (uint32_t i = 0; i < PAGE_SET_WORDS; i++) {
+    m_keep_pages[i] &= ~m_erase_queued[i];
+  }
+  Flash_flush();
 
-  // Wait end of erase
-  if (!active_wait_for_end_of_operation(timeout)) {
-    return APP_PERSISTENT_RES_ACCESS_TIMEOUT;
+  // header and journal are rewritten and the page with the end of the stream
+  // holds bytes we cannot compare, they are always erased
+  for (uint32_t page = 0; page <= (m_header_size - 1) / erase_page_size;
+       page++) {
+    page_clear(m_keep_pages, page);
   }
+  page_clear(m_keep_pages, last_page);
+  m_manifest = *manifest;
+  m_flash_error = APP_RET_OK;
+  m_resumed = false;
 
+  // only the pages used by the stream are erased
+  for (uint32_t page = 0; page <= last_page; page++) {
+    if (!page_test(m_keep_pages, page)) {
+      page_set(m_erase_pages, page);
+    }
+  }
+
+  // the header follows the erase of the first page, the magic stays erased
+  // (0xFF is not programming any bit) till Otap_bufferEnd()
+  otap_buffer_header_t header = {
+      .magic = 0xFFFFFFFF,
+      .image_length = m_manifest.image_length,
+      .sequence = m_manifest.sequence,
+      .encoding = m_manifest.encoding,
+      .stream_length = m_manifest.stream_length,
+      .package_length = m_manifest.package_length,
+      .manifest_magic = OTAP_MANIFEST_MAGIC,
+      .check_image_crc = m_manifest.check_image_crc,
+      .image_crc = m_manifest.image_crc,
+  };
+  size_t amount = align(sizeof(header));
+
+  memset(m_buffer_block_write, 0xFF, amount);
+  memcpy(m_buffer_block_write, &header, sizeof(header));
+  ret = queue_erase(0);
+  if (ret == APP_RET_OK) {
+    ret = Flash_write(0, m_buffer_block_write, amount, flash_done, NULL);
+  }
+
+  // further pages are erased in the background, one after the other,
+  // started when the first one is done, so we can answer now
+  return ret;
+}
+
+int Otap_bufferStored(otap_manifest_t *manifest) {
+  otap_buffer_header_t header;
+
+  if (!m_initialized) {
+    return APP_PERSISTENT_RES_UNINITIALIZED;
+  }
+
+  if (!read(&header, 0, sizeof(header)) || header.magic != 0xFFFFFFFF ||
+      header.manifest_magic != OTAP_MANIFEST_MAGIC) {
+    return APP_RET_NOT_FOUND;
+  }
+
+  manifest->image_length = header.image_length;
+  manifest->sequence = header.sequence;
+  manifest->encoding = header.encoding;
+  manifest->stream_length = header.stream_length;
+  manifest->package_length = header.package_length;
+  manifest->check_image_crc = header.check_image_crc;
+  manifest->image_crc = header.image_crc;
   return APP_RET_OK;
 }
 
-int Otap_bufferEnd(uint32_t totalLen, uint8_t sequence) {
-  uint32_t magic = OTAP_MAGIC;
+/** @brief the page was erased for the upload before the reset
+ *
+ * Its erase entry is set, or a group of packages in it is journaled (its
+ * entry may be lost, the writes are queued behind the erase).
+ */
+static bool is_erased(uint32_t page) {
+  size_t erase_page_size = m_memory_area.flash.erase_sector_size;
+  uint32_t group_size = OTAP_JOURNAL_GROUP_LEN * m_manifest.package_length;
+  uint32_t from = page * erase_page_size;
+  uint32_t to = from + erase_page_size;
+  uint32_t entry;
 
-  // Write Header data:
-  memcpy(m_buffer_block_write, &magic, sizeof(magic));
-  memcpy(m_buffer_block_write + sizeof(magic), &totalLen, sizeof(totalLen));
-  memcpy(m_buffer_block_write + sizeof(magic) + sizeof(totalLen), &sequence,
-         sizeof(sequence));
+  if (!read(&entry, erased_offset(page), sizeof(entry))) {
+    return false;
+  }
+  if (entry == OTAP_JOURNAL_DONE) {
+    return true;
+  }
+  if (to <= m_header_size) {
+    return false;
+  }
+  from = from > m_header_size ? from - m_header_size : 0;
+  to -= m_header_size;
 
-  if (!write(0, m_buffer_block_write, m_header_size)) {
-    return APP_PERSISTENT_RES_FLASH_ERROR;
+  for (uint32_t group = from / group_size;
+       group * group_size < to && group < m_journal_len; group++) {
+    if (read(&entry, journal_offset() + group * journal_entry_size(),
+             sizeof(entry)) &&
+        entry == OTAP_JOURNAL_DONE) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int Otap_bufferResume(const otap_manifest_t *manifest) {
+  size_t erase_page_size = m_memory_area.flash.erase_sector_size;
+  uint32_t last_page;
+  int32_t first;
+  otap_buffer_header_t header;
+
+  if (!m_initialized) {
+    return APP_PERSISTENT_RES_UNINITIALIZED;
+  }
+
+  // a failed write is not in the journal, start again
+  if (m_flash_error != APP_RET_OK) {
+    return APP_RET_NOT_FOUND;
+  }
+
+  if (!read(&header, 0, sizeof(header))) {
+    return APP_RET_NOT_FOUND;
   }
 
+  // finished uploads (magic set) are not continued
+  if (header.magic != 0xFFFFFFFF ||
+      header.manifest_magic != OTAP_MANIFEST_MAGIC ||
+      header.image_length != manifest->image_length ||
+      header.sequence != manifest->sequence ||
+      header.encoding != manifest->encoding ||
+      header.stream_length != manifest->stream_length ||
+      header.package_length != manifest->package_length ||
+      header.check_image_crc != manifest->check_image_crc ||
+      header.image_crc != manifest->image_crc) {
+    return APP_RET_NOT_FOUND;
+  }
+
+  // pages are not known to be kept any more
+  memset(m_keep_pages, 0, sizeof(m_keep_pages));
+  memset(m_select_pages, 0, sizeof(m_select_pages));
+  m_manifest = *manifest;
+  m_resumed = true;
+
+  // pages the background erase did not reach before the reset are erased
+  // before they are written, the first page holds the header
+  Flash_flush();
+  memset(m_erase_pages, 0, sizeof(m_erase_pages));
+  memset(m_erase_queued, 0, sizeof(m_erase_queued));
+  last_page = (m_header_size + m_manifest.stream_length - 1) / erase_page_size;
+  for (uint32_t page = 1; page <= last_page && page < m_num_pages; page++) {
+    if (!is_erased(page)) {
+      page_set(m_erase_pages, page);
+    }
+  }
+  first = page_first(m_erase_pages);
+  if (first >= 0 && queue_erase(first) != APP_RET_OK) {
+    LOG(LVL_DEBUG, "erase postponed");
+  }
   return APP_RET_OK;
 }
-int Otap_bufferWrite(uint8_t *data, uint8_t len, uint32_t offset) {
+
+int Otap_bufferReceived(uint32_t first_package, uint8_t *received,
+                        uint16_t num_packages) {
+  uint32_t entry;
+  uint32_t end = first_package + num_packages;
 
   if (!m_initialized) {
     return APP_PERSISTENT_RES_UNINITIALIZED;
   }
+  if (first_package % OTAP_JOURNAL_GROUP_LEN != 0 ||
+      (end + OTAP_JOURNAL_GROUP_LEN - 1) / OTAP_JOURNAL_GROUP_LEN >
+          m_journal_len) {
+    return APP_RET_INVALID_PARAM;
+  }
 
-  if (len > m_usable_memory_size) {
-    return APP_PERSISTENT_RES_TOO_BIG;
+  // reading would wait for the background erase
+  if (!m_resumed) {
+    return APP_RET_OK;
   }
 
-  if(!write(offset + m_header_size, data, len)) {
-    return APP_PERSISTENT_RES_FLASH_ERROR;
+  for (uint32_t group = first_package / OTAP_JOURNAL_GROUP_LEN;
+       group * OTAP_JOURNAL_GROUP_LEN < end; group++) {
+    if (!read(&entry, journal_offset() + group * journal_entry_size(),
+              sizeof(entry))) {
+      return APP_PERSISTENT_RES_FLASH_ERROR;
+    }
+    if (entry != OTAP_JOURNAL_DONE) {
+      continue;
+    }
+    for (uint32_t i = group * OTAP_JOURNAL_GROUP_LEN;
+         i < (group + 1) * OTAP_JOURNAL_GROUP_LEN && i < end; i++) {
+      received[(i - first_package) / 8] |= 1 << ((i - first_package) % 8);
+    }
   }
-  /* memcpy(&m_buffer_block_write[m_header_size + offset], data, len); */
   return APP_RET_OK;
+}
+
+int Otap_bufferProgress(uint32_t group) {
+  uint32_t entry_offset = journal_offset() + group * journal_entry_size();
+  int ret;
+
+  if (!m_initialized) {
+    return APP_PERSISTENT_RES_UNINITIALIZED;
+  }
+  if (group >= m_journal_len) {
+    return APP_RET_INVALID_PARAM;
+  }
+  // do not journal a group, which may not be written
+  if (m_flash_error != APP_RET_OK) {
+    return m_flash_error;
+  }
+
+  // queued behind the writes of the group, so the entry is never set for
+  // data not yet in the flash
+  // the journal may reach into pages behind the first one
+  ret = queue_erase_range(entry_offset, journal_entry_size());
+  if (ret != APP_RET_OK) {
+    return ret;
+  }
+  memset(m_buffer_block_write, 0xFF, journal_entry_size());
+  memset(m_buffer_block_write, 0x00, sizeof(uint32_t));
+  return Flash_write(entry_offset, m_buffer_block_write, journal_entry_size(),
+                     flash_done, NULL);
+}
 
+bool Otap_isKept(uint32_t offset, uint32_t len) {
+  size_t erase_page_size = m_memory_area.flash.erase_sector_size;
+  uint32_t first_page = (m_header_size + offset) / erase_page_size;
+  uint32_t last_page = (m_header_size + offset + len - 1) / erase_page_size;
 
+  if (!m_initialized || len == 0 || first_page != last_page ||
+      first_page >= m_num_pages) {
+    return false;
+  }
+  return page_test(m_keep_pages, first_page);
 }
 
-uint8_t m_test[16];
-int Otap_process() {
-  uint32_t magic = OTAP_MAGIC;
-  uint32_t len = 0;
-  size_t block_size = 0;
-  uint8_t sequence = 0;
+void Otap_pageInfo(uint16_t *page_size, uint16_t *header_size,
+                   uint8_t *num_pages) {
+  *page_size = m_memory_area.flash.erase_sector_size;
+  *header_size = m_header_size;
+  *num_pages = m_num_pages;
+}
 
-  int ret = APP_RES_OK;
+int Otap_pageHash(uint8_t page, uint32_t *hash) {
+  size_t erase_page_size = m_memory_area.flash.erase_sector_size;
+  uint32_t from = page * erase_page_size;
+  uint32_t to = from + erase_page_size;
+  size_t amount;
+  uint32_t crc = CRC32_INIT;
 
   if (!m_initialized) {
-    LOG(LVL_ERROR, "OTAP not initialized");
     return APP_PERSISTENT_RES_UNINITIALIZED;
   }
+  if (page >= m_num_pages) {
+    return APP_RET_INVALID_PARAM;
+  }
 
-  read(m_buffer_block_write, 0, m_header_size);
+  // only the data part is hashed
+  if (from < m_header_size) {
+    from = m_header_size;
+  }
 
-  if (memcmp(m_buffer_block_write, &magic, sizeof(magic)) != 0) {
-    LOG(LVL_ERROR, "Magic number not found");
-    return -1;
+  for (; from < to; from += amount) {
+    amount = (to - from) > BLOCK_SIZE ? BLOCK_SIZE : to - from;
+    const uint8_t *data = view(from, amount, m_buffer_block_read[0]);
+    if (data == NULL) {
+      return APP_PERSISTENT_RES_FLASH_ERROR;
+    }
+    crc = Crc32_update(crc, data, amount);
   }
 
-  // len has to be in miniumum 96 bytes an devidable by 4
-  len = *((uint32_t *)(m_buffer_block_write + sizeof(magic)));
-  if (len % 4 != 0 || len < 96) {
-    LOG(LVL_ERROR, "Invalid length");
-    return -1;
+  *hash = crc;
+  return APP_RET_OK;
+}
+
+/** @brief prepare the decoder for the stored stream */
+static void decode_init(const otap_buffer_header_t *header,
+                        otap_stream_sink_fp sink, void *sink_ctx) {
+  OtapStream_init(&m_stream, header->encoding, header->image_length, sink,
+                  sink_ctx);
+  OtapStream_setBase(&m_stream, (const uint8_t *)OTAP_APPLICATION_AREA_ADDRESS,
+                     OTAP_APPLICATION_AREA_LENGTH, m_base_version);
+}
+
+/** @brief decode the next blocks of the stored stream
+ *
+ * Internal flash is decoded in place. External flash is read block by
+ * block, the next block is read while the current one is decoded.
+ *
+ * @param length stream length
+ * @param block_size read in blocks of this size, up to BLOCK_SIZE
+ * @param[in,out] offset stream bytes decoded so far
+ * @param max_blocks decode up to this many blocks
+ */
+static int decode_blocks(uint32_t length, size_t block_size, uint32_t *offset,
+                         uint32_t max_blocks) {
+  size_t amount = (length - *offset) > block_size ? block_size
+                                                  : length - *offset;
+  uint8_t cur = 0;
+  int ret;
+
+  if (*offset >= length) {
+    return APP_RET_OK;
   }
 
-  // len has to be in miniumum 96 bytes an devidable by 4
-  sequence = *((uint8_t *)(m_buffer_block_write + sizeof(magic) + sizeof(len)));
-  LOG(LVL_INFO, "Otap_process: len=%d, sequence=%d", len, sequence);
+  // internal flash is decoded in place, nothing to read
+  if (!m_memory_area.external_flash) {
+    const uint8_t *data = view(m_header_size + *offset, length - *offset, NULL);
 
-  // update works only, if wirepas stack is not running
-  if (lib_state->getStackState() == APP_LIB_STATE_STARTED) {
-    LOG(LVL_ERROR, "Stack is running");
-    return -1;
+    if (data == NULL) {
+      return APP_PERSISTENT_RES_FLASH_ERROR;
+    }
+    for (uint32_t n = 0; n < max_blocks && *offset < length; n++) {
+      amount = (length - *offset) > block_size ? block_size : length - *offset;
+      ret = OtapStream_feed(&m_stream, data, amount);
+      if (ret != APP_RET_OK) {
+        LOG(LVL_ERROR, "otap (%d) decode failed %d", *offset, ret);
+        return ret;
+      }
+      data += amount;
+      *offset += amount;
+    }
+    return APP_RET_OK;
   }
 
-  if (lib_otap->begin(len, sequence) != APP_RES_OK) {
-    LOG(LVL_ERROR, "otap begin failed");
+  if (!read(m_buffer_block_read[cur], m_header_size + *offset, amount)) {
     return APP_PERSISTENT_RES_FLASH_ERROR;
   }
 
-  read(m_test, m_header_size + len-16, 16);
-  LOG_BUFFER(LVL_INFO, m_test, 16);
+  for (uint32_t n = 0; n < max_blocks && *offset < length; n++) {
+    uint32_t next = *offset + amount;
+    size_t next_amount = (length - next) > block_size ? block_size
+                                                      : length - next;
+    // the last block of the call is not read ahead
+    bool read_ahead = next < length && n + 1 < max_blocks;
 
-  block_size = BLOCK_SIZE;
-  if (block_size > lib_otap->getMaxBlockNumBytes()) {
-    block_size = lib_otap->getMaxBlockNumBytes();
+    // start reading the next block, while this one is decoded and written
+    if (read_ahead) {
+      if (Flash_read(m_buffer_block_read[!cur], m_header_size + next,
+                     next_amount, NULL, NULL) != APP_RET_OK) {
+        return APP_PERSISTENT_RES_FLASH_ERROR;
+      }
+      Flash_run();
+    }
+
+    ret = OtapStream_feed(&m_stream, m_buffer_block_read[cur], amount);
+    if (ret != APP_RET_OK) {
+      LOG(LVL_ERROR, "otap (%d) decode failed %d", *offset, ret);
+      Flash_flush();
+      return ret;
+    }
+
+    if (read_ahead && Flash_flush() != APP_RET_OK) {
+      return APP_PERSISTENT_RES_FLASH_ERROR;
+    }
+    *offset = next;
+    amount = next_amount;
+    cur = !cur;
   }
-  // write data to the scratchpad area:
-  for (size_t i = 0; i < len; i += block_size) {
-    read(m_buffer_block_write, m_header_size + i, block_size);
-    if ((i + block_size) >= len) {
-      LOG(LVL_INFO, "Otap_process: last block,  %d/ %d",i,  len - i);
-      /* LOG_BUFFER(LVL_INFO, m_buffer_block_write, 16); */
+  return APP_RET_OK;
+}
+
+/** @brief sink of the CRC pass in Otap_bufferEnd(), CRC32 over the image
+ *
+ * @param sink_ctx pointer to the CRC (uint32_t)
+ */
+static int image_crc(const uint8_t *data, size_t len, uint32_t offset,
+                     void *sink_ctx) {
+  uint32_t *crc = (uint32_t *)sink_ctx;
+
+  *crc = Crc32_update(*crc, data, len);
+  return APP_RET_OK;
+}
+
+/** execution time of end_task(), OTAP_PROCESS_BLOCKS_PER_SLICE blocks
+ * decoded into the CRC */
+#define OTAP_END_EXEC_TIME_US 10000
+
+/** CRC pass over the stored stream, running in end_task() */
+static struct {
+  /** stream bytes decoded so far */
+  uint32_t offset;
+  uint32_t crc;
+  otap_process_done_cb_f done_cb;
+} m_end;
+
+/** @brief mark the buffer complete, the rest of the header was written in
+ * Otap_bufferBegin() */
+static int write_magic(void) {
+  uint32_t magic = OTAP_MAGIC;
+  int ret;
+
+  memset(m_buffer_block_write, 0xFF, align(sizeof(magic)));
+  memcpy(m_buffer_block_write, &magic, sizeof(magic));
+  ret = Flash_write(0, m_buffer_block_write, align(sizeof(magic)), NULL, NULL);
+  if (ret == APP_RET_OK) {
+    ret = Flash_flush();
+  }
+  return ret;
+}
+
+/** @brief App_Scheduler task, decodes a few blocks into the image CRC */
+static uint32_t end_task(void) {
+  uint32_t length = m_manifest.stream_length;
+  int ret = APP_RET_OK;
+
+  if (m_manifest.check_image_crc) {
+    ret = decode_blocks(length, BLOCK_SIZE, &m_end.offset,
+                        OTAP_PROCESS_BLOCKS_PER_SLICE);
+    if (ret == APP_RET_OK && m_end.offset < length) {
+      return APP_SCHEDULER_SCHEDULE_ASAP;
+    }
+    if (ret == APP_RET_OK) {
+      ret = OtapStream_finish(&m_stream);
     }
-    ret = lib_otap->write(i, ((len - i) > block_size) ? block_size : len - i,
-                          m_buffer_block_write);
-    if (ret != APP_LIB_OTAP_WRITE_RES_OK  && ret != APP_LIB_OTAP_WRITE_RES_COMPLETED_OK) {
-      LOG(LVL_ERROR, "otap (%d) write failed %d", i, ret);
-      return -1;
+    if (ret == APP_RET_OK && m_end.crc != m_manifest.image_crc) {
+      LOG(LVL_ERROR, "image crc 0x%08x, expected 0x%08x", m_end.crc,
+          m_manifest.image_crc);
+      ret = APP_RET_OTAP_IMAGE_CRC;
     }
   }
+  if (ret == APP_RET_OK) {
+    ret = write_magic();
+  }
+  m_end.done_cb(ret);
+  return APP_SCHEDULER_STOP_TASK;
+}
+
+int Otap_bufferEnd(otap_process_done_cb_f done_cb) {
+  otap_buffer_header_t header = {
+      .image_length = m_manifest.image_length,
+      .encoding = m_manifest.encoding,
+      .stream_length = m_manifest.stream_length,
+  };
+
+  if (!m_initialized) {
+    return APP_PERSISTENT_RES_UNINITIALIZED;
+  }
+
+  // all packages are queued, wait for them and the remaining erases
+  Flash_flush();
+  if (m_flash_error != APP_RET_OK) {
+    return m_flash_error;
+  }
+
+  memset(&m_end, 0, sizeof(m_end));
+  m_end.done_cb = done_cb;
+
+  // one pass over the stored stream, cheaper than a failed Otap_process
+  // after the reboot. It runs in the background like the copy
+  if (m_manifest.check_image_crc) {
+    m_end.crc = CRC32_INIT;
+    decode_init(&header, image_crc, &m_end.crc);
+  }
+  if (App_Scheduler_addTask_execTime(end_task, APP_SCHEDULER_SCHEDULE_ASAP,
+                                     OTAP_END_EXEC_TIME_US) !=
+      APP_SCHEDULER_RES_OK) {
+    return APP_RET_TASK_ERROR;
+  }
+  return APP_RET_OK;
+}
+/** @brief reject a patch for another firmware with its first package, the
+ * stream would fail to decode only after the whole upload
+ *
+ * @param offset position of data in the stream
+ */
+static int check_base(otap_encoding_e encoding, const uint8_t *data,
+                      uint8_t len, uint32_t offset) {
+  if (encoding != OTAP_ENCODING_DELTA) {
+    return APP_RET_OK;
+  }
+  for (; len > 0 && offset < OTAP_DELTA_HEADER_LEN; len--, offset++) {
+    if (*data++ != m_base_version[offset]) {
+      LOG(LVL_ERROR, "patch not made for %d.%d.%d.%d", VER_MAJOR, VER_MINOR,
+          VER_MAINT, VER_DEV);
+      return APP_RET_OTAP_BASE_VERSION;
+    }
+  }
+  return APP_RET_OK;
+}
+
+int Otap_bufferWrite(uint8_t *data, uint8_t len, uint32_t offset) {
+  int ret;
+
+  if (!m_initialized) {
+    return APP_PERSISTENT_RES_UNINITIALIZED;
+  }
+
+  if (offset > m_usable_memory_size || len > m_usable_memory_size - offset) {
+    return APP_PERSISTENT_RES_TOO_BIG;
+  }
+
+  ret = check_base(m_manifest.encoding, data, len, offset);
+  if (ret != APP_RET_OK) {
+    return ret;
+  }
+
+  // packages are copied into the flash queue
+  if (len > FLASH_WRITE_COPY_LEN) {
+    return APP_RET_INVALID_LENGTH;
+  }
+
+  // the background erase did not reach the page yet, erase it first
+  if (len > 0) {
+    ret = queue_erase_range(offset + m_header_size, len);
+    if (ret != APP_RET_OK) {
+      return ret;
+    }
+  }
+
+  // data is copied, the flash is written later
+  return Flash_write(offset + m_header_size, data, len, flash_done, NULL);
+
+
+}
+
+/** @brief sink for the decoded image, collects a block for lib_otap->write
+ *
+ * @param sink_ctx pointer to the block size (size_t)
+ */
+static int write_scratchpad(const uint8_t *data, size_t len, uint32_t offset,
+                            void *sink_ctx) {
+  size_t block_size = *((size_t *)sink_ctx);
+  // decoder hands over the bytes in order, the block starts at a multiple of
+  // block_size
+  size_t block_pos = offset % block_size;
+  int ret;
+
+  while (len > 0) {
+    size_t amount = (block_size - block_pos) < len ? block_size - block_pos : len;
+    memcpy(m_buffer_block_write + block_pos, data, amount);
+    block_pos += amount;
+    offset += amount;
+    data += amount;
+    len -= amount;
+
+    if (block_pos == block_size || offset == m_stream.image_length) {
+      ret = lib_otap->write(offset - block_pos, block_pos, m_buffer_block_write);
+      if (ret != APP_LIB_OTAP_WRITE_RES_OK &&
+          ret != APP_LIB_OTAP_WRITE_RES_COMPLETED_OK) {
+        LOG(LVL_ERROR, "otap (%d) write failed %d", offset - block_pos, ret);
+        return APP_RET_ERROR_INTERNAL;
+      }
+      block_pos = 0;
+    }
+  }
+  return APP_RET_OK;
+}
+
+/** @brief the scratchpad is complete, let the stack process it at the next
+ * boot and propagate it to the network */
+static int activate_scratchpad(void) {
+  int ret;
 
   ret = lib_otap->setTargetScratchpadAndAction(lib_otap->getSeq(),
                                            lib_otap->getCrc(),
@@ -285,4 +987,299 @@ int Otap_process() {
   return APP_RET_OK;
 }
 
+/** execution time of process_task(), OTAP_PROCESS_BLOCKS_PER_SLICE blocks
+ * written to the scratchpad */
+#define OTAP_PROCESS_EXEC_TIME_US 30000
+
+/** copy into the scratchpad, running in process_task() */
+static struct {
+  otap_buffer_header_t header;
+  /** lib_otap->write block size */
+  size_t block_size;
+  /** stream bytes decoded so far */
+  uint32_t offset;
+  /** scratchpad already written before a reset, only activate it */
+  bool written;
+  app_lib_time_timestamp_hp_t start;
+  otap_process_done_cb_f done_cb;
+} m_process;
+
+/** @brief the scratchpad is written and activated, a reset before the
+ * stack processes it must not copy it again */
+static void mark_copied(void) {
+  uint8_t entry[FLASH_WRITE_COPY_LEN];
+
+  memset(entry, 0xFF, journal_entry_size());
+  memset(entry, 0x00, sizeof(uint32_t));
+  if (Flash_write(copied_offset(), entry, journal_entry_size(), NULL, NULL) !=
+          APP_RET_OK ||
+      Flash_flush() != APP_RET_OK) {
+    // the next Otap_process() copies it again
+    LOG(LVL_ERROR, "otap copy entry lost");
+  }
+}
+
+/** @brief the scratchpad was written and activated by an earlier
+ * Otap_process() */
+static bool is_copied(void) {
+  uint32_t entry;
+
+  return read(&entry, copied_offset(), sizeof(entry)) &&
+         entry == OTAP_JOURNAL_DONE;
+}
+
+/** @brief App_Scheduler task, copies a few blocks into the scratchpad */
+static uint32_t process_task(void) {
+  uint32_t length = m_process.header.stream_length;
+  uint32_t duration_us;
+  int ret = APP_RET_OK;
+
+  if (!m_process.written) {
+    ret = decode_blocks(length, m_process.block_size, &m_process.offset,
+                        OTAP_PROCESS_BLOCKS_PER_SLICE);
+    if (ret == APP_RET_OK && m_process.offset < length) {
+      LOG(LVL_DEBUG, "otap copy %u/%u", m_process.offset, length);
+      return APP_SCHEDULER_SCHEDULE_ASAP;
+    }
+    if (ret == APP_RET_OK) {
+      ret = OtapStream_finish(&m_stream);
+    }
+    if (ret != APP_RET_OK) {
+      LOG(LVL_ERROR, "otap decode failed %d", ret);
+    } else {
+      duration_us = lib_time->getTimeDiffUs(lib_time->getTimestampHp(),
+                                            m_process.start);
+      LOG(LVL_INFO, "otap copy: %u bytes in %u ms, %u bytes/s",
+          m_process.header.image_length, duration_us / 1000,
+          duration_us > 0 ? (uint32_t)((uint64_t)m_process.header.image_length *
+                                       1000000 / duration_us)
+                          : 0);
+    }
+  }
+
+  if (ret == APP_RET_OK) {
+    ret = activate_scratchpad();
+  }
+  if (ret == APP_RET_OK && !m_process.written) {
+    mark_copied();
+  }
+  m_process.done_cb(ret);
+  return APP_SCHEDULER_STOP_TASK;
+}
+
+/** @brief count this call of Otap_process() in the buffer header
+ *
+ * @return APP_RET_OK, APP_RET_OTAP_ATTEMPTS if all attempts are used
+ */
+static int count_attempt(void) {
+  uint32_t entry;
+
+  for (uint32_t attempt = 0; attempt < OTAP_PROCESS_MAX_ATTEMPTS; attempt++) {
+    if (!read(&entry, attempt_offset(attempt), sizeof(entry))) {
+      return APP_PERSISTENT_RES_FLASH_ERROR;
+    }
+    if (entry == OTAP_JOURNAL_DONE) {
+      continue;
+    }
+    LOG(LVL_INFO, "otap process attempt %u", attempt + 1);
+    memset(m_buffer_block_write, 0xFF, journal_entry_size());
+    memset(m_buffer_block_write, 0x00, sizeof(uint32_t));
+    if (Flash_write(attempt_offset(attempt), m_buffer_block_write,
+                    journal_entry_size(), NULL, NULL) != APP_RET_OK ||
+        Flash_flush() != APP_RET_OK) {
+      return APP_PERSISTENT_RES_FLASH_ERROR;
+    }
+    return APP_RET_OK;
+  }
+  return APP_RET_OTAP_ATTEMPTS;
+}
+
+int Otap_process(otap_process_done_cb_f done_cb) {
+  otap_buffer_header_t header;
+  uint32_t len = 0;
+  int ret = APP_RES_OK;
+
+  if (!m_initialized) {
+    LOG(LVL_ERROR, "OTAP not initialized");
+    return APP_PERSISTENT_RES_UNINITIALIZED;
+  }
+
+  // the journal behind the header is not needed here
+  read(&header, 0, sizeof(header));
+
+  if (header.magic != OTAP_MAGIC) {
+    LOG(LVL_ERROR, "Magic number not found");
+    return -1;
+  }
+
+  // len has to be in miniumum 96 bytes an devidable by 4
+  len = header.image_length;
+  if (len % 4 != 0 || len < 96) {
+    LOG(LVL_ERROR, "Invalid length");
+    return -1;
+  }
+
+  if (header.stream_length > m_usable_memory_size) {
+    LOG(LVL_ERROR, "Invalid stream length");
+    return -1;
+  }
+
+  LOG(LVL_INFO, "Otap_process: len=%d, sequence=%d, encoding=%d, stream=%d",
+      len, header.sequence, header.encoding, header.stream_length);
+
+  // update works only, if wirepas stack is not running
+  if (lib_state->getStackState() == APP_LIB_STATE_STARTED) {
+    LOG(LVL_ERROR, "Stack is running");
+    return -1;
+  }
+
+  // a copy crashing the device must not loop forever
+  ret = count_attempt();
+  if (ret != APP_RET_OK) {
+    LOG(LVL_ERROR, "otap buffer given up %d", ret);
+    return ret;
+  }
+
+  memset(&m_process, 0, sizeof(m_process));
+  m_process.header = header;
+  m_process.done_cb = done_cb;
+
+  // reset after the scratchpad was activated, the scratchpad is complete
+  if (is_copied()) {
+    LOG(LVL_INFO, "otap scratchpad already written");
+    m_process.written = true;
+  } else {
+    if (lib_otap->begin(len, header.sequence) != APP_RES_OK) {
+      LOG(LVL_ERROR, "otap begin failed");
+      return APP_PERSISTENT_RES_FLASH_ERROR;
+    }
+
+    // read in the size lib_otap writes, a raw stream is then written as it
+    // is read
+    m_process.block_size = BLOCK_SIZE;
+    if (m_process.block_size > lib_otap->getMaxBlockNumBytes()) {
+      m_process.block_size = lib_otap->getMaxBlockNumBytes();
+    }
+    decode_init(&header, write_scratchpad, &m_process.block_size);
+  }
+
+  // decode the stored stream into the scratchpad area in the background
+  m_process.start = lib_time->getTimestampHp();
+  if (App_Scheduler_addTask_execTime(process_task, APP_SCHEDULER_SCHEDULE_ASAP,
+                                     OTAP_PROCESS_EXEC_TIME_US) !=
+      APP_SCHEDULER_RES_OK) {
+    return APP_RET_TASK_ERROR;
+  }
+  return APP_RET_OK;
+}
+
+/** @brief sink of the direct upload, CRC32 over the image on the way */
+static int write_scratchpad_direct(const uint8_t *data, size_t len,
+                                   uint32_t offset, void *sink_ctx) {
+  m_direct.image_crc = Crc32_update(m_direct.image_crc, data, len);
+  return write_scratchpad(data, len, offset, sink_ctx);
+}
+
+int Otap_directBegin(const otap_manifest_t *manifest) {
+  if (manifest->package_length == 0 ||
+      manifest->package_length > OTAP_DIRECT_PACKAGE_LEN) {
+    return APP_RET_INVALID_PARAM;
+  }
+
+  // the scratchpad can only be written with the stack stopped
+  if (lib_state->getStackState() == APP_LIB_STATE_STARTED &&
+      lib_state->stopStack() != APP_RES_OK) {
+    LOG(LVL_ERROR, "cannot stop stack");
+    return APP_RET_INVALID_STATE;
+  }
+
+  if (lib_otap->begin(manifest->image_length, manifest->sequence) !=
+      APP_RES_OK) {
+    LOG(LVL_ERROR, "otap begin failed");
+    return APP_PERSISTENT_RES_FLASH_ERROR;
+  }
+
+  memset(&m_direct, 0, sizeof(m_direct));
+  m_direct.active = true;
+  m_direct.manifest = *manifest;
+  m_direct.image_crc = CRC32_INIT;
+  m_direct.block_size = BLOCK_SIZE;
+  if (m_direct.block_size > lib_otap->getMaxBlockNumBytes()) {
+    m_direct.block_size = lib_otap->getMaxBlockNumBytes();
+  }
+
+  OtapStream_init(&m_stream, manifest->encoding, manifest->image_length,
+                  write_scratchpad_direct, &m_direct.block_size);
+  OtapStream_setBase(&m_stream, (const uint8_t *)OTAP_APPLICATION_AREA_ADDRESS,
+                     OTAP_APPLICATION_AREA_LENGTH, m_base_version);
+  return APP_RET_OK;
+}
+
+int Otap_directWrite(uint8_t *data, uint8_t len, uint32_t package) {
+  uint8_t slot;
+  int ret = APP_RET_OK;
+
+  if (!m_direct.active) {
+    return APP_RET_INVALID_STATE;
+  }
+
+  // already decoded, a repeated package
+  if (package < m_direct.next_package) {
+    return APP_RET_OK;
+  }
+  // no room, the smartphone sends it again
+  if (package >= m_direct.next_package + OTAP_DIRECT_WINDOW) {
+    return APP_RET_BUSY;
+  }
+  if (len != m_direct.manifest.package_length) {
+    return APP_RET_INVALID_LENGTH;
+  }
+  ret = check_base(m_direct.manifest.encoding, data, len, package * len);
+  if (ret != APP_RET_OK) {
+    m_direct.active = false;
+    return ret;
+  }
+
+  slot = package % OTAP_DIRECT_WINDOW;
+  memcpy(m_direct.window[slot], data, len);
+  m_direct.present[slot / 32] |= 1UL << (slot % 32);
+
+  // feed everything, which is in order now
+  slot = m_direct.next_package % OTAP_DIRECT_WINDOW;
+  while (ret == APP_RET_OK &&
+         (m_direct.present[slot / 32] & (1UL << (slot % 32)))) {
+    m_direct.present[slot / 32] &= ~(1UL << (slot % 32));
+    ret = OtapStream_feed(&m_stream, m_direct.window[slot], len);
+    m_direct.next_package++;
+    slot = m_direct.next_package % OTAP_DIRECT_WINDOW;
+  }
+
+  if (ret != APP_RET_OK) {
+    LOG(LVL_ERROR, "otap (%d) decode failed %d", m_direct.next_package, ret);
+    m_direct.active = false;
+  }
+  return ret;
+}
+
+int Otap_directEnd(void) {
+  int ret;
+
+  if (!m_direct.active) {
+    return APP_RET_INVALID_STATE;
+  }
+  m_direct.active = false;
+
+  ret = OtapStream_finish(&m_stream);
+  if (ret != APP_RET_OK) {
+    return ret;
+  }
+  if (m_direct.manifest.check_image_crc &&
+      m_direct.image_crc != m_direct.manifest.image_crc) {
+    LOG(LVL_ERROR, "image crc 0x%08x, expected 0x%08x", m_direct.image_crc,
+        m_direct.manifest.image_crc);
+    return APP_RET_OTAP_IMAGE_CRC;
+  }
+  return activate_scratchpad();
+}
+
 int Otap_bufferToScratch(void) { return APP_RES_OK; }
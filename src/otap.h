@@ -24,6 +24,7 @@
 #define OTAP_H
 
 #include "app_app.h"
+#include "otap_stream.h"
 
 /** @brief  Magic number for the OTAP record
  *  !!! DO NOT change
@@ -42,6 +43,53 @@ typedef struct __attribute__ ((packed))
 } app_persistent_otap_t;
 
 
+/** upload progress is journaled in flash in groups of this many packages */
+#define OTAP_JOURNAL_GROUP_LEN 32
+
+/** pages (erase sectors) of the buffer area, which are used, numbered with
+ * an uint8_t in the page hash protocol */
+#define OTAP_MAX_PAGES 255
+
+/** Otap_process(): stream blocks copied per run of the task */
+#define OTAP_PROCESS_BLOCKS_PER_SLICE 4
+/** Otap_process(): copies started from the same buffer, before giving up */
+#define OTAP_PROCESS_MAX_ATTEMPTS 3
+
+/** smallest package length (iOS), sizes the journal */
+#define OTAP_MIN_PACKAGE_LENGTH 12
+
+/** direct upload: packages received ahead of the next one in order */
+#define OTAP_DIRECT_WINDOW 64
+/** direct upload: maximal package length (compact data frame on Android) */
+#define OTAP_DIRECT_PACKAGE_LEN 25
+
+/** @brief description of an upload, stored in the buffer header
+ *  the same manifest in a new begin request continues the upload
+ */
+typedef struct {
+    /** size of the scratchpad image (decoded) */
+    uint32_t image_length;
+    /** scratchpad sequence number */
+    uint8_t sequence;
+    /** how the uploaded stream is encoded */
+    otap_encoding_e encoding;
+    /** number of bytes uploaded into the buffer */
+    uint32_t stream_length;
+    /** stream bytes in every upload package */
+    uint8_t package_length;
+    /** verify image_crc in Otap_bufferEnd() */
+    bool check_image_crc;
+    /** CRC32 (see crc.h) of the decoded scratchpad image */
+    uint32_t image_crc;
+} otap_manifest_t;
+
+/** @brief Otap_process() or Otap_bufferEnd() is done
+ *
+ * @param result APP_RET_OK if the scratchpad is written and marked to be
+ *        processed (the buffer is marked), the error otherwise
+ */
+typedef void (*otap_process_done_cb_f)(int result);
+
 /** @brief  Initialize the OTAP module
  * must be called befor any other function
  *
@@ -51,30 +99,176 @@ int Otap_init(void);
 
 /** @brief beforeWriting, the buffer has to be erased
  *
+ * Pages (erase sectors) already holding the right data can be kept, their
+ * upload packages do not have to be sent again. The pages with the header
+ * and the page with the end of the stream are always erased.
+ * The manifest is written to the header, so an interrupted upload can be
+ * continued with Otap_bufferResume().
+ * Only the pages needed for the stream are erased. This happens in the
+ * background, one page after the other, so the function returns at once.
+ * Otap_bufferWrite() queues the erase of a page itself, if the background
+ * is behind.
+ *
+ * @param manifest upload, which will follow
+ * @param keep_pages keep the pages selected with Otap_keepPages()
+ * @return APP_RET_OK, APP_PERSISTENT_RES_TOO_BIG if the stream does not fit
+ *         into the area or the journal
+ */
+int Otap_bufferBegin(const otap_manifest_t *manifest, bool keep_pages);
+
+/** @brief select pages to keep in the next Otap_bufferBegin()
+ *
+ * @param first_page page of bit 0
+ * @param pages one bit per page, which shall not be erased
  */
-int Otap_bufferBegin(void);
+void Otap_keepPages(uint8_t first_page, uint32_t pages);
+
+/** @brief continue an interrupted upload of the same image
+ *
+ * @param manifest upload requested by the smartphone
+ * @return APP_RET_OK if the buffer holds an unfinished upload with the
+ *         same manifest, APP_RET_NOT_FOUND otherwise
+ */
+int Otap_bufferResume(const otap_manifest_t *manifest);
+
+/** @brief manifest of the unfinished upload in the buffer
+ *
+ * An upload is only continued with the same manifest, e.g. the package
+ * length chosen at its begin.
+ *
+ * @param[out] manifest read from the buffer header
+ * @return APP_RET_OK or APP_RET_NOT_FOUND, if there is no unfinished upload
+ */
+int Otap_bufferStored(otap_manifest_t *manifest);
+
+/** @brief packages of the current upload, which are journaled
+ *
+ * The receive state is kept in segments, so it is asked for one segment
+ * at a time.
+ *
+ * @param first_package first package of the segment, a multiple of
+ *        OTAP_JOURNAL_GROUP_LEN
+ * @param[out] received one bit per package of the segment, set for
+ *             journaled packages
+ * @param num_packages number of packages in the segment
+ */
+int Otap_bufferReceived(uint32_t first_package, uint8_t *received,
+                        uint16_t num_packages);
+
+/** @brief journal a completely received group of packages
+ *
+ * call once per group, every journal entry can only be written once
+ *
+ * @param group package number / OTAP_JOURNAL_GROUP_LEN
+ */
+int Otap_bufferProgress(uint32_t group);
+
+/** @brief check, if the given stream range is in a page kept by Otap_bufferBegin()
+ *
+ * @param offset position in the stream
+ * @param len number of bytes
+ * @return true, if the data is already in the buffer
+ */
+bool Otap_isKept(uint32_t offset, uint32_t len);
+
+/** @brief layout of the buffer, needed by the smartphone to compare page hashes
+ *
+ * page n covers the stream bytes [n * page_size - header_size, (n + 1) * page_size - header_size)
+ *
+ * @param[out] page_size size of an erase sector
+ * @param[out] header_size bytes in front of the stream
+ * @param[out] num_pages number of pages in the buffer
+ */
+void Otap_pageInfo(uint16_t *page_size, uint16_t *header_size, uint8_t *num_pages);
+
+/** @brief CRC32 (see crc.h) of the stream bytes in the given page
+ *
+ * @param page page number
+ * @param[out] hash CRC32
+ * @return APP_RET_OK if successful
+ */
+int Otap_pageHash(uint8_t page, uint32_t *hash);
 
 /** @brief when everything is ok, mark the buffer with the magic number
  *
+ * Otap_process() only accepts buffers marked here. Waits for the queued
+ * flash operations and fails, if one of them failed.
+ * If the manifest has an image CRC, the stream is decoded once and the
+ * image is checked against it, so a broken upload does not cost a reboot.
+ * The check runs in an App_Scheduler task, OTAP_PROCESS_BLOCKS_PER_SLICE
+ * blocks at a time, like Otap_process().
+ *
+ * @param done_cb called from the task with APP_RET_OK, if the buffer is
+ *        marked, APP_RET_OTAP_IMAGE_CRC if the image does not match or the
+ *        error of the flash or the decoder
+ * @return APP_RET_OK if the task is started, done_cb is called later
  */
-int Otap_bufferEnd(uint32_t totalLen, uint8_t sequence);
+int Otap_bufferEnd(otap_process_done_cb_f done_cb);
 
 /**
  * @brief  Store the given data in the persistent memory
- * This will be done in blocks for 4 kByte because the flash has to be erased before writing
+ * The data is copied and queued (see flash.h), the function does not wait
+ * for the flash. Errors are reported by Otap_bufferEnd().
  *
+ * @return APP_RET_OK if queued, APP_RET_BUSY if the queue is full
  */
 int Otap_bufferWrite(uint8_t * data, uint8_t len, uint32_t offset);
 
 /** @brief After the Buffer has filled with data, call this function to
  * write into the Scratch Area
  *
+ * An encoded stream is decoded on the fly, so the buffer only has to hold
+ * the uploaded (compressed) bytes.
+ * The copy runs in an App_Scheduler task, OTAP_PROCESS_BLOCKS_PER_SLICE
+ * blocks at a time, so the caller is not blocked till it is done.
+ *
+ * Every call is counted in the buffer header. lib_otap->begin() starts the
+ * scratchpad over, so a copy interrupted by a reset is started again from
+ * the beginning, a scratchpad completely written before the reset is only
+ * marked to be processed. After OTAP_PROCESS_MAX_ATTEMPTS the buffer is
+ * given up with APP_RET_OTAP_ATTEMPTS.
+ *
+ * @param done_cb called from the task, when the copy is done or failed
+ * @return APP_RET_OK if the task is started, done_cb is called later
  *
  * @warning: This function only works, if the stack has stopped
  *
  */
-int Otap_process(void) ;
+int Otap_process(otap_process_done_cb_f done_cb);
 
 int Otap_bufferToScratch(void);
 
+/** @brief upload straight into the scratchpad, without the buffer area
+ *
+ * The stack is stopped, as lib_otap can only be written then. The packages
+ * are reordered in a window of OTAP_DIRECT_WINDOW packages and decoded
+ * into lib_otap as soon as they are in order. After Otap_directEnd() the
+ * node has to reboot, which processes the scratchpad. An aborted upload
+ * has to reboot as well, to start the stack again.
+ *
+ * Relies on lib_state->stopStack() returning with the app still running,
+ * which is not given by every SDK release: check app_lib_state.h of the
+ * wm-sdk submodule, when it is updated. The caller falls back to the buffer
+ * on APP_RET_INVALID_STATE.
+ *
+ * @param manifest upload, which will follow
+ * @return APP_RET_OK, APP_RET_INVALID_STATE if the stack cannot be stopped
+ */
+int Otap_directBegin(const otap_manifest_t *manifest);
+
+/** @brief hand over a package of the direct upload
+ *
+ * @param package package number in the upload
+ * @return APP_RET_OK if taken (or already decoded), APP_RET_BUSY if too far
+ *         ahead, it has to be sent again later, or the error of the decoder
+ */
+int Otap_directWrite(uint8_t *data, uint8_t len, uint32_t package);
+
+/** @brief all packages are written, check the image and activate it
+ *
+ * @return APP_RET_OK, APP_RET_OTAP_IMAGE_CRC, APP_RET_DATA_SIZE or the error
+ *         of lib_otap
+ */
+int Otap_directEnd(void);
+
 #endif
@@ -0,0 +1,278 @@
+/* *
+ * Wirepas BLE communication example
+ *
+ * Made in the swiss alps, 2023 <marcel.graber@steinel.ch>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* include global header first */
+#include "app_app.h"
+
+#include "otap_stream.h"
+#define DEBUG_LOG_MODULE_NAME "STREAM"
+#ifdef DEBUG_APP_LOG_MAX_LEVEL
+#define DEBUG_LOG_MAX_LEVEL DEBUG_APP_LOG_MAX_LEVEL
+#else
+#define DEBUG_LOG_MAX_LEVEL LVL_NOLOG
+#endif
+#include "debug_log.h"
+
+/** heatshrink decoder states, named after the field we are reading */
+typedef enum {
+    HS_STATE_TAG = 0,
+    HS_STATE_LITERAL,
+    HS_STATE_BACKREF_INDEX,
+    HS_STATE_BACKREF_COUNT,
+} hs_state_e;
+
+/** delta decoder states, named after the field we are reading */
+typedef enum {
+    DELTA_STATE_VERSION = 0,
+    DELTA_STATE_OP,
+    DELTA_STATE_LENGTH,
+    DELTA_STATE_OFFSET,
+    DELTA_STATE_INSERT,
+} delta_state_e;
+
+static int flush(otap_stream_t* stream) {
+    int ret = APP_RET_OK;
+
+    if (stream->out_len > 0) {
+        ret = stream->sink(stream->out, stream->out_len,
+                           stream->image_offset - stream->out_len,
+                           stream->sink_ctx);
+        stream->out_len = 0;
+    }
+    return ret;
+}
+
+static int emit(otap_stream_t* stream, uint8_t byte) {
+    // anything behind the image is padding of the last package
+    if (stream->image_offset >= stream->image_length) {
+        return APP_RET_OK;
+    }
+
+    stream->window[stream->window_pos] = byte;
+    stream->window_pos = (stream->window_pos + 1) % OTAP_STREAM_WINDOW_SIZE;
+
+    stream->out[stream->out_len++] = byte;
+    stream->image_offset++;
+
+    if (stream->out_len == OTAP_STREAM_OUT_LEN) {
+        return flush(stream);
+    }
+    return APP_RET_OK;
+}
+
+static void expect(otap_stream_t* stream, hs_state_e state, uint8_t bits) {
+    stream->state = state;
+    stream->bits_missing = bits;
+    stream->bits = 0;
+}
+
+/** @brief a field of the heatshrink stream is complete, act on it */
+static int heatshrinkField(otap_stream_t* stream) {
+    int ret = APP_RET_OK;
+
+    switch (stream->state) {
+    case HS_STATE_TAG:
+        if (stream->bits) {
+            expect(stream, HS_STATE_LITERAL, 8);
+        } else {
+            expect(stream, HS_STATE_BACKREF_INDEX, OTAP_STREAM_WINDOW_BITS);
+        }
+        break;
+
+    case HS_STATE_LITERAL:
+        ret = emit(stream, (uint8_t)stream->bits);
+        expect(stream, HS_STATE_TAG, 1);
+        break;
+
+    case HS_STATE_BACKREF_INDEX:
+        stream->backref_index = stream->bits + 1;
+        expect(stream, HS_STATE_BACKREF_COUNT, OTAP_STREAM_LOOKAHEAD_BITS);
+        break;
+
+    case HS_STATE_BACKREF_COUNT:
+        for (uint16_t i = 0; i <= stream->bits && ret == APP_RET_OK; i++) {
+            uint16_t pos = (stream->window_pos + OTAP_STREAM_WINDOW_SIZE - stream->backref_index) %
+                           OTAP_STREAM_WINDOW_SIZE;
+            ret = emit(stream, stream->window[pos]);
+        }
+        expect(stream, HS_STATE_TAG, 1);
+        break;
+    }
+    return ret;
+}
+
+static int heatshrinkFeed(otap_stream_t* stream, const uint8_t* data, size_t len) {
+    int ret = APP_RET_OK;
+
+    for (size_t i = 0; i < len && ret == APP_RET_OK; i++) {
+        // heatshrink packs the fields msb first
+        for (uint8_t mask = 0x80; mask != 0 && ret == APP_RET_OK; mask >>= 1) {
+            stream->bits = (stream->bits << 1) | ((data[i] & mask) ? 1 : 0);
+            if (--stream->bits_missing == 0) {
+                ret = heatshrinkField(stream);
+            }
+        }
+    }
+    return ret;
+}
+
+static void collect(otap_stream_t* stream, delta_state_e state, uint8_t len) {
+    stream->state = state;
+    stream->value = 0;
+    stream->value_pos = 0;
+    stream->value_len = len;
+}
+
+/** @brief a field of the delta stream is complete, act on it */
+static int deltaField(otap_stream_t* stream) {
+    int ret = APP_RET_OK;
+
+    if (stream->state == DELTA_STATE_LENGTH) {
+        stream->op_length = (uint16_t)stream->value;
+        if (stream->op == OTAP_DELTA_OP_COPY) {
+            collect(stream, DELTA_STATE_OFFSET, 4);
+        } else {
+            stream->state = (stream->op_length > 0) ? DELTA_STATE_INSERT : DELTA_STATE_OP;
+        }
+    } else {
+        // copy operation: offset in base image is complete
+        if (stream->value > stream->base_length ||
+                stream->op_length > stream->base_length - stream->value) {
+            LOG(LVL_ERROR, "copy outside of base: %u+%u", stream->value, stream->op_length);
+            return APP_RET_INVALID_DATA;
+        }
+        for (uint16_t i = 0; i < stream->op_length && ret == APP_RET_OK; i++) {
+            ret = emit(stream, stream->base[stream->value + i]);
+        }
+        stream->state = DELTA_STATE_OP;
+    }
+    return ret;
+}
+
+static int deltaFeed(otap_stream_t* stream, const uint8_t* data, size_t len) {
+    int ret = APP_RET_OK;
+
+    for (size_t i = 0; i < len && ret == APP_RET_OK; i++) {
+        switch (stream->state) {
+        case DELTA_STATE_VERSION:
+            if (data[i] != stream->base_version[stream->value_pos]) {
+                LOG(LVL_ERROR, "patch not made for this version");
+                return APP_RET_OTAP_BASE_VERSION;
+            }
+            if (++stream->value_pos == OTAP_DELTA_HEADER_LEN) {
+                stream->state = DELTA_STATE_OP;
+            }
+            break;
+
+        case DELTA_STATE_OP:
+            // anything behind the image is padding of the last package
+            if (stream->image_offset >= stream->image_length) {
+                return APP_RET_OK;
+            }
+            if (data[i] != OTAP_DELTA_OP_INSERT && data[i] != OTAP_DELTA_OP_COPY) {
+                LOG(LVL_ERROR, "unknown delta operation: %d", data[i]);
+                return APP_RET_INVALID_DATA;
+            }
+            stream->op = data[i];
+            collect(stream, DELTA_STATE_LENGTH, 2);
+            break;
+
+        case DELTA_STATE_LENGTH:
+        case DELTA_STATE_OFFSET:
+            stream->value |= (uint32_t)data[i] << (8 * stream->value_pos);
+            if (++stream->value_pos == stream->value_len) {
+                ret = deltaField(stream);
+            }
+            break;
+
+        case DELTA_STATE_INSERT:
+            ret = emit(stream, data[i]);
+            if (--stream->op_length == 0) {
+                stream->state = DELTA_STATE_OP;
+            }
+            break;
+        }
+    }
+    return ret;
+}
+
+void OtapStream_init(otap_stream_t* stream,
+                     otap_encoding_e encoding,
+                     uint32_t image_length,
+                     otap_stream_sink_fp sink,
+                     void* sink_ctx) {
+    __ASSERT(NULL != stream, "stream must not be NULL");
+    __ASSERT(NULL != sink, "sink must not be NULL");
+
+    memset(stream, 0, sizeof(otap_stream_t));
+    stream->encoding = encoding;
+    stream->image_length = image_length;
+    stream->sink = sink;
+    stream->sink_ctx = sink_ctx;
+    if (encoding == OTAP_ENCODING_DELTA) {
+        collect(stream, DELTA_STATE_VERSION, OTAP_DELTA_HEADER_LEN);
+    } else {
+        expect(stream, HS_STATE_TAG, 1);
+    }
+}
+
+void OtapStream_setBase(otap_stream_t* stream,
+                        const uint8_t* base,
+                        uint32_t base_length,
+                        const uint8_t* version) {
+    stream->base = base;
+    stream->base_length = base_length;
+    stream->base_version = version;
+}
+
+int OtapStream_feed(otap_stream_t* stream, const uint8_t* data, size_t len) {
+    int ret = APP_RET_OK;
+
+    switch (stream->encoding) {
+    case OTAP_ENCODING_RAW:
+        for (size_t i = 0; i < len && ret == APP_RET_OK; i++) {
+            ret = emit(stream, data[i]);
+        }
+        break;
+
+    case OTAP_ENCODING_HEATSHRINK:
+        ret = heatshrinkFeed(stream, data, len);
+        break;
+
+    case OTAP_ENCODING_DELTA:
+        ret = deltaFeed(stream, data, len);
+        break;
+
+    default:
+        LOG(LVL_ERROR, "unknown encoding: %d", stream->encoding);
+        ret = APP_RET_NOT_SUPPORTED;
+        break;
+    }
+    return ret;
+}
+
+int OtapStream_finish(otap_stream_t* stream) {
+    int ret = flush(stream);
+
+    if (ret == APP_RET_OK && stream->image_offset != stream->image_length) {
+        LOG(LVL_ERROR, "stream decoded to %u of %u bytes",
+            stream->image_offset, stream->image_length);
+        ret = APP_RET_DATA_SIZE;
+    }
+    return ret;
+}
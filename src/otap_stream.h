@@ -0,0 +1,156 @@
+/* *
+ * Wirepas BLE communication example
+ *
+ * Made in the swiss alps, 2023 <marcel.graber@steinel.ch>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file    otap_stream.h
+ * @brief   Decoder for the uploaded OTAP stream
+ *
+ * The smartphone can upload the scratchpad image as it is (raw) or encoded
+ * to save air time. The stored stream is fed in order to the decoder, which
+ * emits the scratchpad image in order to the given sink.
+ *
+ * Delta stream (@ref OTAP_ENCODING_DELTA), all values little endian:
+ *  - [0:3] version of the base image: major, minor, maintenance, development
+ *  - followed by operations until the image is complete:
+ *    - insert: [0] 0x00, [1:2] length, [3:] length bytes of the new image
+ *    - copy:   [0] 0x01, [1:2] length, [3:6] offset in the base image
+ *
+ */
+#ifndef OTAP_STREAM_H
+#define OTAP_STREAM_H
+
+#include "app_app.h"
+
+/** heatshrink parameters, the smartphone has to use the same
+ * (heatshrink -w 8 -l 4) */
+#define OTAP_STREAM_WINDOW_BITS     8
+#define OTAP_STREAM_LOOKAHEAD_BITS  4
+#define OTAP_STREAM_WINDOW_SIZE     (1 << OTAP_STREAM_WINDOW_BITS)
+
+/** decoded bytes are collected and handed over to the sink in this size */
+#define OTAP_STREAM_OUT_LEN 32
+
+/** Encoding of the uploaded stream
+ *  !!! DO NOT change, stored in the OTAP buffer header
+ */
+typedef enum {
+    /** stream is the scratchpad image itself */
+    OTAP_ENCODING_RAW = 0,
+    /** stream is heatshrink compressed */
+    OTAP_ENCODING_HEATSHRINK = 1,
+    /** stream is a patch against the base image, see above */
+    OTAP_ENCODING_DELTA = 2,
+} otap_encoding_e;
+
+/** operations in a delta stream */
+typedef enum {
+    OTAP_DELTA_OP_INSERT = 0x00,
+    OTAP_DELTA_OP_COPY = 0x01,
+} otap_delta_op_e;
+
+/** size of the delta stream header (base version) */
+#define OTAP_DELTA_HEADER_LEN 4
+
+/** @brief receives the decoded image in order
+ *
+ * @param  data decoded bytes
+ * @param  len number of bytes in data
+ * @param  offset position of data in the scratchpad image
+ * @param  sink_ctx context given in OtapStream_init()
+ * @return APP_RET_OK or an error code, which stops the decoder
+ */
+typedef int (*otap_stream_sink_fp)(const uint8_t* data, size_t len, uint32_t offset, void* sink_ctx);
+
+/** @brief decoder instance, allocate statically */
+typedef struct {
+    otap_encoding_e encoding;
+    otap_stream_sink_fp sink;
+    void* sink_ctx;
+    /** size of the decoded image, everything behind is padding */
+    uint32_t image_length;
+    /** decoded bytes so far */
+    uint32_t image_offset;
+    /** heatshrink: what the next bits are used for */
+    uint8_t state;
+    /** heatshrink: number of bits still missing for the current field */
+    uint8_t bits_missing;
+    /** heatshrink: field value collected so far */
+    uint16_t bits;
+    /** heatshrink: distance of the current back reference */
+    uint16_t backref_index;
+    /** heatshrink: history of the decoded bytes */
+    uint8_t window[OTAP_STREAM_WINDOW_SIZE];
+    uint16_t window_pos;
+    uint8_t out[OTAP_STREAM_OUT_LEN];
+    uint8_t out_len;
+    /** delta: image the copy operations refer to */
+    const uint8_t* base;
+    uint32_t base_length;
+    const uint8_t* base_version;
+    /** delta: current operation @ref otap_delta_op_e */
+    uint8_t op;
+    uint16_t op_length;
+    /** delta: little endian field collected so far */
+    uint32_t value;
+    uint8_t value_pos;
+    uint8_t value_len;
+} otap_stream_t;
+
+/** @brief prepare the decoder for a new stream
+ *
+ * @param[out] stream decoder instance
+ * @param encoding encoding of the stream
+ * @param image_length size of the decoded scratchpad image
+ * @param sink called with the decoded bytes
+ * @param sink_ctx passed to sink
+ */
+void OtapStream_init(otap_stream_t* stream,
+                     otap_encoding_e encoding,
+                     uint32_t image_length,
+                     otap_stream_sink_fp sink,
+                     void* sink_ctx);
+
+/** @brief set the image delta streams are applied to
+ *
+ * @param[in, out] stream decoder instance, call after OtapStream_init()
+ * @param base memory mapped base image
+ * @param base_length size of the base image
+ * @param version OTAP_DELTA_HEADER_LEN bytes, the version the patch has to
+ *        be made for, kept by reference
+ */
+void OtapStream_setBase(otap_stream_t* stream,
+                        const uint8_t* base,
+                        uint32_t base_length,
+                        const uint8_t* version);
+
+/** @brief feed the next bytes of the stored stream
+ *
+ * @return APP_RET_OK, APP_RET_OTAP_BASE_VERSION if a delta stream does not
+ *         match the base, APP_RET_INVALID_DATA on a broken stream,
+ *         or the error returned by the sink
+ */
+int OtapStream_feed(otap_stream_t* stream, const uint8_t* data, size_t len);
+
+/** @brief flush the pending bytes to the sink
+ *
+ * @return APP_RET_OK, APP_RET_DATA_SIZE if the stream did not decode to
+ *         image_length bytes, or the error returned by the sink
+ */
+int OtapStream_finish(otap_stream_t* stream);
+
+#endif
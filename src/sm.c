@@ -27,6 +27,64 @@
 #include "debug_log.h"
 
 
+/** @brief index the rows of the event matrix by state and event
+ *
+ * Rows are chained in table order, so the first matching row still wins.
+ */
+static void buildIndex(Sm_context* const me) {
+    memset(me->index, SM_NO_ROW, sizeof(me->index));
+    memset(me->next_row, SM_NO_ROW, sizeof(me->next_row));
+
+    __ASSERT(me->event_matrix_len <= SM_EVENT_MATRIX_MAX_LEN, "event matrix too long");
+    // backwards, every row is put in front of its chain
+    for (uint8_t i = me->event_matrix_len; i > 0; i--) {
+        const sm_event_matrix_t* row = &me->event_matrix[i - 1];
+
+        if (i > SM_EVENT_MATRIX_MAX_LEN || row->state >= sm_S_COUNT || row->event >= sm_E_COUNT) {
+            LOG(LVL_ERROR, "row %u of %s not indexed", i - 1, me->module_name);
+            continue;
+        }
+        me->next_row[i - 1] = me->index[row->state][row->event];
+        me->index[row->state][row->event] = i - 1;
+    }
+}
+
+/** @brief first row of the event matrix, which takes the event now
+ *
+ * The rows of the current state and those of @ref sm_S_ANY_STATE are
+ * tried in table order, guards are evaluated on the way.
+ *
+ * @return row or SM_NO_ROW
+ */
+static uint8_t findTransition(Sm_context* const me, sm_event_e event) {
+    uint8_t row = SM_NO_ROW;
+    uint8_t any = SM_NO_ROW;
+
+    if (event >= sm_E_COUNT) {
+        return SM_NO_ROW;
+    }
+    if (me->current_state < sm_S_COUNT && me->current_state != sm_S_ANY_STATE) {
+        row = me->index[me->current_state][event];
+    }
+    any = me->index[sm_S_ANY_STATE][event];
+
+    while (row != SM_NO_ROW || any != SM_NO_ROW) {
+        uint8_t i;
+
+        if (any == SM_NO_ROW || (row != SM_NO_ROW && row < any)) {
+            i = row;
+            row = me->next_row[row];
+        } else {
+            i = any;
+            any = me->next_row[any];
+        }
+        if (me->event_matrix[i].guard == NULL || (me->event_matrix[i].guard)(me->module_context)) {
+            return i;
+        }
+    }
+    return SM_NO_ROW;
+}
+
 void Sm_createStatic(Sm_context* me,
                      void * const module_context,
                      char * const module_name,
@@ -82,6 +140,14 @@ void Sm_init(Sm_context* const me,
             ) {
 
     sl_list_init(&me->event_queue_head);
+    sl_list_init(&me->event_free_head);
+    for (uint8_t i = 0; i < event_queue_len; i++) {
+        event_queue[i].event = sm_E_NONE;
+        sl_list_push_front(&me->event_free_head, (sl_list_t*)&event_queue[i]);
+    }
+    me->event_queue_used = 0;
+    me->event_queue_high = 0;
+    me->events_dropped = 0;
     me->current_state = sm_S_BOOT;
     me->module_context = module_context;
     me->module_name = module_name;
@@ -91,28 +157,38 @@ void Sm_init(Sm_context* const me,
     me->event_matrix_len = event_matrix_len;
     me->handleEvents = handleEventsFunction;
     me->exit_action = NULL;
+    buildIndex(me);
 }
 
-void Sm_fireEvent(Sm_context* const me, sm_event_e event_type, uint32_t execution_time) {
-    lib_system->enterCriticalSection();
+int Sm_fireEvent(Sm_context* const me, sm_event_e event_type, uint32_t execution_time) {
+    sm_event_queue_t* slot;
 
-    for (uint8_t i = 0; i < me->event_queue_len; i++) {
-        if (me->event_queue[i].event == sm_E_NONE) {
-            me->event_queue[i].event = event_type;
-            sl_list_push_back(&me->event_queue_head, (sl_list_t*)&me->event_queue[i]);
-            break;
-        }
+    lib_system->enterCriticalSection();
+    slot = (sm_event_queue_t*)sl_list_pop_front(&me->event_free_head);
+    if (slot == NULL) {
+        me->events_dropped++;
+        lib_system->exitCriticalSection();
+        // the handler is scheduled already, the queue is full
+        LOG(LVL_ERROR, "event queue of %s full, dropped %s (%u)", me->module_name,
+            Sm_getEventName(event_type), me->events_dropped);
+        return APP_RET_NO_MEM;
+    }
+    slot->event = event_type;
+    sl_list_push_back(&me->event_queue_head, (sl_list_t*)slot);
+    me->event_queue_used++;
+    if (me->event_queue_used > me->event_queue_high) {
+        me->event_queue_high = me->event_queue_used;
     }
-
     lib_system->exitCriticalSection();
+
     App_Scheduler_addTask_execTime_Caller(me->handleEvents, (void*)me, APP_SCHEDULER_SCHEDULE_ASAP, execution_time);
+    return APP_RET_OK;
 }
 
 
 uint32_t Sm_handleEvents(void* me) {
     uint8_t i;
     sm_event_queue_t* event;
-    bool transition_found = false;
 
     if (me == NULL) {
         return APP_SCHEDULER_STOP_TASK;
@@ -129,50 +205,38 @@ uint32_t Sm_handleEvents(void* me) {
     lib_system->exitCriticalSection();
 
 
-    transition_found = false;
-
     // call entry function
-    for (i = 0; i < sm->event_matrix_len; i++) {
-        if ((event->event == sm->event_matrix[i].event) &&
-                ((sm->current_state == sm->event_matrix[i].state) || (sm->event_matrix[i].state == sm_S_ANY_STATE)) &&
-                ((sm->event_matrix[i].guard == NULL || (sm->event_matrix[i].guard)(sm->module_context)))) {
-
-            LOG(LVL_INFO, "Trans(%s): %s -> %s (%s) (left %u)",
-                sm->module_name,
-                Sm_getStateName(sm->current_state),
-                Sm_getStateName(sm->event_matrix[i].next_state),
-                Sm_getEventName(event->event),
-                sl_list_size(&sm->event_queue_head));
-
-            // call exit action from last state
-            if (sm->exit_action != NULL) {
-                (sm->exit_action)(sm->module_context);
-            }
-
-            // call entry action from new state
-            if (sm->event_matrix[i].entry_function != NULL) {
-                (sm->event_matrix[i].entry_function)(sm->module_context);
-            }
-
-            // set current state
-            if (sm->event_matrix[i].next_state != sm_S_NO_NEW_STATE) {
-                sm->current_state = sm->event_matrix[i].next_state;
-            }
-
-            sm->exit_action = sm->event_matrix[i].exit_function;
-            LOG(LVL_DEBUG, "State: %s",
-                Sm_getStateName(sm->current_state));
-            // break after the first match
-            transition_found = true;
-            break;
+    i = findTransition(sm, event->event);
+    if (i != SM_NO_ROW) {
+        LOG(LVL_INFO, "Trans(%s): %s -> %s (%s) (left %u)",
+            sm->module_name,
+            Sm_getStateName(sm->current_state),
+            Sm_getStateName(sm->event_matrix[i].next_state),
+            Sm_getEventName(event->event),
+            sl_list_size(&sm->event_queue_head));
+
+        // call exit action from last state
+        if (sm->exit_action != NULL) {
+            (sm->exit_action)(sm->module_context);
+        }
+
+        // call entry action from new state
+        if (sm->event_matrix[i].entry_function != NULL) {
+            (sm->event_matrix[i].entry_function)(sm->module_context);
         }
-    }
 
+        // set current state
+        if (sm->event_matrix[i].next_state != sm_S_NO_NEW_STATE) {
+            sm->current_state = sm->event_matrix[i].next_state;
+        }
+
+        sm->exit_action = sm->event_matrix[i].exit_function;
+        LOG(LVL_DEBUG, "State: %s",
+            Sm_getStateName(sm->current_state));
+    }
 
-    // Free event slot
-    event->event = sm_E_NONE;
 
-    if (!transition_found) {
+    if (i == SM_NO_ROW) {
         LOG(LVL_DEBUG, "NO Trans(%s): %s (%s) (left %u)",
             sm->module_name,
             Sm_getStateName(sm->current_state),
@@ -180,6 +244,13 @@ uint32_t Sm_handleEvents(void* me) {
             sl_list_size(&sm->event_queue_head));
     }
 
+    // Free event slot
+    lib_system->enterCriticalSection();
+    event->event = sm_E_NONE;
+    sl_list_push_front(&sm->event_free_head, (sl_list_t*)event);
+    sm->event_queue_used--;
+    lib_system->exitCriticalSection();
+
     return (sl_list_size(&sm->event_queue_head) == 0) ? APP_SCHEDULER_STOP_TASK :
            APP_SCHEDULER_SCHEDULE_ASAP;
 }
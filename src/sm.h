@@ -26,6 +26,11 @@
 
 #include "app_app.h"
 
+/** rows of an event matrix, which are indexed */
+#define SM_EVENT_MATRIX_MAX_LEN 64
+/** no row in the transition index */
+#define SM_NO_ROW UINT8_C(0xFF)
+
 /* "class" StateMachine */
 typedef struct Sm Sm_context;
 
@@ -72,8 +77,21 @@ struct Sm {
     sm_event_queue_t *event_queue;
     uint8_t event_queue_len;
     sl_list_head_t event_queue_head;
+    /** slots of event_queue, which are not queued */
+    sl_list_head_t event_free_head;
+    /** queued events, the most ever queued and the events lost, because
+     * all slots were queued (size event_queue_len from these) */
+    uint8_t event_queue_used;
+    uint8_t event_queue_high;
+    uint16_t events_dropped;
     const sm_event_matrix_t *event_matrix;
     uint8_t event_matrix_len;
+    /** first row of the event matrix per state and event (SM_NO_ROW if
+     * none), built by Sm_init(). The rows of @ref sm_S_ANY_STATE are kept
+     * under that state and are merged in by table order */
+    uint8_t index[sm_S_COUNT][sm_E_COUNT];
+    /** next row with the same state and event, in table order */
+    uint8_t next_row[SM_EVENT_MATRIX_MAX_LEN];
     functionPointerPacketType exit_action;
     uint32_t (*handleEvents)(void* const me);
 };
@@ -124,7 +142,12 @@ void Sm_init(Sm_context* const me,
              );
 
 uint32_t Sm_handleEvents(void * me);
-void Sm_fireEvent(Sm_context* const me, sm_event_e event_type, uint32_t execution_time);
+/** @brief queue an event and schedule its handling
+ *
+ * @return APP_RET_OK or APP_RET_NO_MEM, if all slots are queued (the event
+ *         is dropped and counted)
+ */
+int Sm_fireEvent(Sm_context* const me, sm_event_e event_type, uint32_t execution_time);
 
 
 #endif // SM_H_